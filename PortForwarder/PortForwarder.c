@@ -1,521 +1,6442 @@
-/*
- * Windows TCP Port Forwarder with IP Filtering
- * Redirects TCP traffic from a local port to a remote host:port
- * Optionally filters by source IP address
- *
- * Usage: PortForwarder.exe <local_port> <remote_host> <remote_port> [allowed_ip] [-v]
- * Example: PortForwarder.exe 8080 192.168.1.100 80
- * Example: PortForwarder.exe 8080 192.168.1.100 80 192.168.1.50
- * Example: PortForwarder.exe 8080 192.168.1.100 80 192.168.1.50 -v
- */
-
-#include <winsock2.h>
-#include <ws2tcpip.h>
-#include <windows.h>
-#include <mstcpip.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-
-#pragma comment(lib, "ws2_32.lib")
-
-#define BUFFER_SIZE 8192
-#define MAX_CONNECTIONS 100
-
-typedef struct {
-    SOCKET client_socket;
-    SOCKET remote_socket;
-    HANDLE thread_handle;
-    int active;
-    unsigned long long bytes_client_to_remote;
-    unsigned long long bytes_remote_to_client;
-} connection_t;
-
-// Global variables for cleanup
-connection_t connections[MAX_CONNECTIONS];
-SOCKET listen_socket = INVALID_SOCKET;
-volatile int running = 1;
-CRITICAL_SECTION conn_lock;
-char* allowed_ip = NULL;  // NULL means allow all IPs
-int verbose_mode = 0;     // Verbose mode for IP filtering (default: off)
-
-// Forward declarations
-void cleanup();
-BOOL WINAPI console_handler(DWORD signal);
-
-// Error handling function
-void print_error(const char* msg) {
-    fprintf(stderr, "[ERROR] %s: %d\n", msg, WSAGetLastError());
-}
-
-// Check if IP is allowed
-int is_ip_allowed(const char* client_ip) {
-    if (allowed_ip == NULL) {
-        return 1;  // No filter, allow all
-    }
-    return strcmp(client_ip, allowed_ip) == 0;
-}
-
-// Forward data bidirectionally between two sockets
-DWORD WINAPI forward_thread(LPVOID param) {
-    connection_t* conn = (connection_t*)param;
-    SOCKET client = conn->client_socket;
-    SOCKET remote = conn->remote_socket;
-
-    fd_set readfds;
-    char buffer[BUFFER_SIZE];
-    int max_fd;
-    struct timeval timeout;
-
-    // Set sockets to blocking mode for reliable data transfer
-    u_long mode = 0;
-    ioctlsocket(client, FIONBIO, &mode);
-    ioctlsocket(remote, FIONBIO, &mode);
-
-    // Set socket timeouts to detect dead connections
-    int timeout_ms = 30000; // 30 seconds
-    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout_ms, sizeof(timeout_ms));
-    setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, (char*)&timeout_ms, sizeof(timeout_ms));
-    setsockopt(remote, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout_ms, sizeof(timeout_ms));
-    setsockopt(remote, SOL_SOCKET, SO_SNDTIMEO, (char*)&timeout_ms, sizeof(timeout_ms));
-
-    // Disable Nagle's algorithm for lower latency
-    int flag = 1;
-    setsockopt(client, IPPROTO_TCP, TCP_NODELAY, (char*)&flag, sizeof(int));
-    setsockopt(remote, IPPROTO_TCP, TCP_NODELAY, (char*)&flag, sizeof(int));
-
-    // Set keepalive with more aggressive settings
-    int keepalive = 1;
-    setsockopt(client, SOL_SOCKET, SO_KEEPALIVE, (char*)&keepalive, sizeof(int));
-    setsockopt(remote, SOL_SOCKET, SO_KEEPALIVE, (char*)&keepalive, sizeof(int));
-
-    // Set TCP keepalive parameters (Windows-specific)
-    struct tcp_keepalive ka_settings;
-    ka_settings.onoff = 1;
-    ka_settings.keepalivetime = 10000;     // Start probing after 10 seconds
-    ka_settings.keepaliveinterval = 1000;  // Probe every 1 second
-    DWORD bytes_returned;
-    WSAIoctl(client, SIO_KEEPALIVE_VALS, &ka_settings, sizeof(ka_settings),
-        NULL, 0, &bytes_returned, NULL, NULL);
-    WSAIoctl(remote, SIO_KEEPALIVE_VALS, &ka_settings, sizeof(ka_settings),
-        NULL, 0, &bytes_returned, NULL, NULL);
-
-    printf("[INFO] Connection established, forwarding traffic...\n");
-
-    conn->bytes_client_to_remote = 0;
-    conn->bytes_remote_to_client = 0;
-
-    while (running && conn->active) {
-        FD_ZERO(&readfds);
-        FD_SET(client, &readfds);
-        FD_SET(remote, &readfds);
-
-        // Calculate max fd (Windows doesn't use this but keep for portability reference)
-        max_fd = (client > remote ? client : remote) + 1;
-
-        // Wait for data with timeout
-        timeout.tv_sec = 1;
-        timeout.tv_usec = 0;
-
-        int result = select(max_fd, &readfds, NULL, NULL, &timeout);
-
-        if (result == SOCKET_ERROR) {
-            print_error("select() failed");
-            break;
-        }
-
-        if (result == 0) {
-            // Timeout, continue loop to check running flag
-            continue;
-        }
-
-        // Client -> Remote
-        if (FD_ISSET(client, &readfds)) {
-            int bytes_received = recv(client, buffer, BUFFER_SIZE, 0);
-
-            if (bytes_received <= 0) {
-                if (bytes_received == 0) {
-                    printf("[INFO] Client closed connection gracefully\n");
-                }
-                else {
-                    int error = WSAGetLastError();
-                    // Handle common errors gracefully
-                    switch (error) {
-                    case WSAECONNRESET:
-                        printf("[INFO] Client connection reset by peer\n");
-                        break;
-                    case WSAECONNABORTED:
-                        printf("[INFO] Client connection aborted\n");
-                        break;
-                    case WSAENETRESET:
-                        printf("[INFO] Network reset caused client disconnect\n");
-                        break;
-                    case WSAETIMEDOUT:
-                        printf("[INFO] Client connection timed out\n");
-                        break;
-                    default:
-                        fprintf(stderr, "[ERROR] recv() from client failed: %d\n", error);
-                    }
-                }
-                break;
-            }
-
-            // Forward all data to remote
-            int total_sent = 0;
-            while (total_sent < bytes_received) {
-                int bytes_sent = send(remote, buffer + total_sent,
-                    bytes_received - total_sent, 0);
-
-                if (bytes_sent == SOCKET_ERROR) {
-                    int error = WSAGetLastError();
-                    switch (error) {
-                    case WSAECONNRESET:
-                        printf("[INFO] Remote connection reset while sending\n");
-                        break;
-                    case WSAECONNABORTED:
-                        printf("[INFO] Remote connection aborted while sending\n");
-                        break;
-                    default:
-                        fprintf(stderr, "[ERROR] send() to remote failed: %d\n", error);
-                    }
-                    goto cleanup_thread;
-                }
-                total_sent += bytes_sent;
-            }
-            conn->bytes_client_to_remote += bytes_received;
-        }
-
-        // Remote -> Client
-        if (FD_ISSET(remote, &readfds)) {
-            int bytes_received = recv(remote, buffer, BUFFER_SIZE, 0);
-
-            if (bytes_received <= 0) {
-                if (bytes_received == 0) {
-                    printf("[INFO] Remote closed connection gracefully\n");
-                }
-                else {
-                    int error = WSAGetLastError();
-                    // Handle common errors gracefully
-                    switch (error) {
-                    case WSAECONNRESET:
-                        printf("[INFO] Remote connection reset by peer\n");
-                        break;
-                    case WSAECONNABORTED:
-                        printf("[INFO] Remote connection aborted\n");
-                        break;
-                    case WSAENETRESET:
-                        printf("[INFO] Network reset caused remote disconnect\n");
-                        break;
-                    case WSAETIMEDOUT:
-                        printf("[INFO] Remote connection timed out\n");
-                        break;
-                    default:
-                        fprintf(stderr, "[ERROR] recv() from remote failed: %d\n", error);
-                    }
-                }
-                break;
-            }
-
-            // Forward all data to client
-            int total_sent = 0;
-            while (total_sent < bytes_received) {
-                int bytes_sent = send(client, buffer + total_sent,
-                    bytes_received - total_sent, 0);
-
-                if (bytes_sent == SOCKET_ERROR) {
-                    int error = WSAGetLastError();
-                    switch (error) {
-                    case WSAECONNRESET:
-                        printf("[INFO] Client connection reset while sending\n");
-                        break;
-                    case WSAECONNABORTED:
-                        printf("[INFO] Client connection aborted while sending\n");
-                        break;
-                    default:
-                        fprintf(stderr, "[ERROR] send() to client failed: %d\n", error);
-                    }
-                    goto cleanup_thread;
-                }
-                total_sent += bytes_sent;
-            }
-            conn->bytes_remote_to_client += bytes_received;
-        }
-    }
-
-cleanup_thread:
-    printf("[INFO] Closing connection (Sent: %llu bytes, Received: %llu bytes, Total: %llu bytes)\n",
-        conn->bytes_client_to_remote, conn->bytes_remote_to_client,
-        conn->bytes_client_to_remote + conn->bytes_remote_to_client);
-
-    // Graceful shutdown
-    shutdown(client, SD_BOTH);
-    shutdown(remote, SD_BOTH);
-    closesocket(client);
-    closesocket(remote);
-
-    EnterCriticalSection(&conn_lock);
-    conn->active = 0;
-    LeaveCriticalSection(&conn_lock);
-
-    return 0;
-}
-
-// Handle new client connection
-int handle_connection(SOCKET client_socket, const char* remote_host, int remote_port) {
-    SOCKET remote_socket = INVALID_SOCKET;
-    struct addrinfo hints, * result = NULL;
-    char port_str[16];
-    int conn_index = -1;
-
-    // Convert port to string
-    snprintf(port_str, sizeof(port_str), "%d", remote_port);
-
-    // Resolve remote address
-    ZeroMemory(&hints, sizeof(hints));
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_protocol = IPPROTO_TCP;
-
-    if (getaddrinfo(remote_host, port_str, &hints, &result) != 0) {
-        print_error("getaddrinfo() failed");
-        closesocket(client_socket);
-        return -1;
-    }
-
-    // Create socket and connect to remote
-    remote_socket = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
-    if (remote_socket == INVALID_SOCKET) {
-        print_error("socket() creation failed");
-        freeaddrinfo(result);
-        closesocket(client_socket);
-        return -1;
-    }
-
-    if (connect(remote_socket, result->ai_addr, (int)result->ai_addrlen) == SOCKET_ERROR) {
-        print_error("connect() to remote failed");
-        freeaddrinfo(result);
-        closesocket(remote_socket);
-        closesocket(client_socket);
-        return -1;
-    }
-
-    freeaddrinfo(result);
-    printf("[INFO] Connected to remote %s:%d\n", remote_host, remote_port);
-
-    // Find free connection slot
-    EnterCriticalSection(&conn_lock);
-    for (int i = 0; i < MAX_CONNECTIONS; i++) {
-        if (!connections[i].active) {
-            conn_index = i;
-            connections[i].client_socket = client_socket;
-            connections[i].remote_socket = remote_socket;
-            connections[i].active = 1;
-            break;
-        }
-    }
-    LeaveCriticalSection(&conn_lock);
-
-    if (conn_index == -1) {
-        fprintf(stderr, "[ERROR] Maximum connections reached\n");
-        closesocket(remote_socket);
-        closesocket(client_socket);
-        return -1;
-    }
-
-    // Create forwarding thread
-    connections[conn_index].thread_handle = CreateThread(
-        NULL, 0, forward_thread, &connections[conn_index], 0, NULL);
-
-    if (connections[conn_index].thread_handle == NULL) {
-        fprintf(stderr, "[ERROR] CreateThread() failed: %lu\n", GetLastError());
-        EnterCriticalSection(&conn_lock);
-        connections[conn_index].active = 0;
-        LeaveCriticalSection(&conn_lock);
-        closesocket(remote_socket);
-        closesocket(client_socket);
-        return -1;
-    }
-
-    return 0;
-}
-
-// Cleanup function
-void cleanup() {
-    printf("\n[INFO] Shutting down...\n");
-    running = 0;
-
-    // Close listening socket
-    if (listen_socket != INVALID_SOCKET) {
-        closesocket(listen_socket);
-        listen_socket = INVALID_SOCKET;
-    }
-
-    // Wait for all threads to finish
-    EnterCriticalSection(&conn_lock);
-    for (int i = 0; i < MAX_CONNECTIONS; i++) {
-        if (connections[i].active) {
-            connections[i].active = 0;
-            if (connections[i].thread_handle != NULL) {
-                LeaveCriticalSection(&conn_lock);
-                WaitForSingleObject(connections[i].thread_handle, 5000);
-                EnterCriticalSection(&conn_lock);
-                CloseHandle(connections[i].thread_handle);
-            }
-        }
-    }
-    LeaveCriticalSection(&conn_lock);
-
-    DeleteCriticalSection(&conn_lock);
-    WSACleanup();
-    printf("[INFO] Cleanup complete\n");
-}
-
-// Console control handler
-BOOL WINAPI console_handler(DWORD signal) {
-    if (signal == CTRL_C_EVENT || signal == CTRL_BREAK_EVENT) {
-        cleanup();
-        exit(0);
-    }
-    return TRUE;
-}
-
-int main(int argc, char* argv[]) {
-    WSADATA wsa_data;
-    struct sockaddr_in server_addr;
-    int local_port, remote_port;
-    char* remote_host;
-
-    printf("=== Windows TCP Port Forwarder with IP Filtering ===\n\n");
-
-    // Parse arguments
-    if (argc < 4 || argc > 6) {
-        fprintf(stderr, "Usage: %s <local_port> <remote_host> <remote_port> [allowed_ip] [-v]\n", argv[0]);
-        fprintf(stderr, "  -v: Enable verbose mode (show rejected connections)\n\n");
-        fprintf(stderr, "Examples:\n");
-        fprintf(stderr, "  %s 8080 192.168.1.100 80\n", argv[0]);
-        fprintf(stderr, "  %s 8080 192.168.1.100 80 192.168.1.50\n", argv[0]);
-        fprintf(stderr, "  %s 8080 192.168.1.100 80 192.168.1.50 -v\n", argv[0]);
-        return 1;
-    }
-
-    local_port = atoi(argv[1]);
-    remote_host = argv[2];
-    remote_port = atoi(argv[3]);
-
-    // Parse optional arguments (allowed_ip and -v flag)
-    for (int i = 4; i < argc; i++) {
-        if (strcmp(argv[i], "-v") == 0 || strcmp(argv[i], "--verbose") == 0) {
-            verbose_mode = 1;
-        }
-        else {
-            // Assume it's the allowed IP
-            allowed_ip = argv[i];
-        }
-    }
-
-    if (local_port <= 0 || local_port > 65535 || remote_port <= 0 || remote_port > 65535) {
-        fprintf(stderr, "[ERROR] Invalid port number\n");
-        return 1;
-    }
-
-    printf("[INFO] Configuration:\n");
-    printf("  Local port:  %d\n", local_port);
-    printf("  Remote host: %s\n", remote_host);
-    printf("  Remote port: %d\n", remote_port);
-    if (allowed_ip != NULL) {
-        printf("  Allowed IP:  %s (filtered mode)\n", allowed_ip);
-        printf("  Verbose:     %s\n", verbose_mode ? "ON" : "OFF");
-    }
-    else {
-        printf("  Allowed IP:  ANY (no filtering)\n");
-    }
-    printf("\n");
-
-    // Initialize Winsock
-    if (WSAStartup(MAKEWORD(2, 2), &wsa_data) != 0) {
-        fprintf(stderr, "[ERROR] WSAStartup() failed\n");
-        return 1;
-    }
-
-    // Initialize critical section and connections
-    InitializeCriticalSection(&conn_lock);
-    memset(connections, 0, sizeof(connections));
-
-    // Set console handler for cleanup
-    SetConsoleCtrlHandler(console_handler, TRUE);
-
-    // Create listening socket
-    listen_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    if (listen_socket == INVALID_SOCKET) {
-        print_error("socket() creation failed");
-        WSACleanup();
-        return 1;
-    }
-
-    // Set socket options
-    int reuse = 1;
-    if (setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR,
-        (char*)&reuse, sizeof(reuse)) == SOCKET_ERROR) {
-        print_error("setsockopt() failed");
-    }
-
-    // Bind socket
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(local_port);
-
-    if (bind(listen_socket, (struct sockaddr*)&server_addr, sizeof(server_addr)) == SOCKET_ERROR) {
-        print_error("bind() failed");
-        cleanup();
-        return 1;
-    }
-
-    // Listen for connections
-    if (listen(listen_socket, SOMAXCONN) == SOCKET_ERROR) {
-        print_error("listen() failed");
-        cleanup();
-        return 1;
-    }
-
-    printf("[INFO] Listening on port %d...\n", local_port);
-    printf("[INFO] Press Ctrl+C to stop\n\n");
-
-    // Accept connections
-    while (running) {
-        struct sockaddr_in client_addr;
-        int client_addr_len = sizeof(client_addr);
-
-        SOCKET client_socket = accept(listen_socket,
-            (struct sockaddr*)&client_addr,
-            &client_addr_len);
-
-        if (client_socket == INVALID_SOCKET) {
-            if (running) {
-                print_error("accept() failed");
-            }
-            break;
-        }
-
-        char client_ip[INET_ADDRSTRLEN];
-        inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, INET_ADDRSTRLEN);
-
-        // Check if IP is allowed
-        if (!is_ip_allowed(client_ip)) {
-            if (verbose_mode) {
-                printf("[INFO] Connection from %s:%d REJECTED (IP not allowed)\n",
-                    client_ip, ntohs(client_addr.sin_port));
-            }
-            closesocket(client_socket);
-            continue;
-        }
-
-        printf("[INFO] New connection from %s:%d ACCEPTED\n",
-            client_ip, ntohs(client_addr.sin_port));
-
-        // Handle connection in new thread
-        handle_connection(client_socket, remote_host, remote_port);
-    }
-
-    cleanup();
-    return 0;
+/*
+ * Windows TCP Port Forwarder with IP Filtering
+ * Redirects TCP traffic from a local port to a remote host:port
+ * Optionally filters by source IP address
+ * Optionally terminates TLS on the listener (Schannel)
+ * Optionally multiplexes client streams over long-lived links to a peer forwarder,
+ * striped across links and/or LZ4-compressed
+ * Optionally mirrors client traffic to a shadow backend
+ * Optionally captures relayed payloads to a pcap-ng file
+ * Optionally shows a live, top-style view of active connections
+ * Optionally serves a local control socket (list, kill, drain, rate limits, stats)
+ * Optionally writes a binary access log (decode with --decode-log)
+ * Optionally times each stage (accept, DNS, connect, TLS, relay, logging) with the TSC
+ * Emits ETW tracepoints at accept, upstream connect, first byte and close (off until a session enables them)
+ * Optionally busy-polls latency-critical connections instead of sleeping in select()
+ * Optionally spreads connections over several backends, favouring the fastest
+ * Listens on IPv6 and IPv4 at once (dual-stack) unless told to stay on IPv4
+ *
+ * Usage: PortForwarder.exe <local_port> <remote_host> <remote_port> [allowed_ip] [-v] [options]
+ * Example: PortForwarder.exe 8080 192.168.1.100 80
+ * Example: PortForwarder.exe 8080 192.168.1.100 80 192.168.1.50
+ * Example: PortForwarder.exe 8080 192.168.1.100 80 192.168.1.50 -v
+ * Example: PortForwarder.exe 443 192.168.1.100 80 --tls-cert forwarder.example.com
+ * Example: PortForwarder.exe 5432 exit.example.com 9000 --peer-connect   (entry side)
+ *          PortForwarder.exe 9000 10.0.0.20 5432 --peer-listen           (exit side)
+ * Example: PortForwarder.exe --ctl C:\ProgramData\pf.sock list
+ * Example: PortForwarder.exe --decode-log access.bin csv
+ */
+
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <windows.h>
+#include <mstcpip.h>
+#include <iphlpapi.h>
+#include <afunix.h>
+#define SECURITY_WIN32
+#include <security.h>
+#include <schannel.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <math.h>
+#include <intrin.h>
+#ifndef PF_NO_TRACE
+#include <TraceLoggingProvider.h>
+#endif
+
+#pragma comment(lib, "ws2_32.lib")
+#pragma comment(lib, "secur32.lib")
+#pragma comment(lib, "crypt32.lib")
+#pragma comment(lib, "advapi32.lib")
+#pragma comment(lib, "iphlpapi.lib")
+
+#define BUFFER_SIZE 8192
+#define MAX_CONNECTIONS 100
+#define TLS_BUFFER_SIZE 32768  // Largest TLS record (16KB + overhead) with room for handshake flights
+#define MUX_MAX_LINKS 16
+#define MUX_FRAME_HEADER 12
+#define MUX_MAX_PAYLOAD 16384
+#define MUX_DEFAULT_WINDOW 262144  // Per-stream receive window: bytes in flight in each direction
+#define MUX_MAX_WINDOW (64 * 1024 * 1024)
+#define MUX_MAGIC 0x50465832   // "PFX2", sent in HELLO so a stray client can't speak the protocol
+#define MUX_RETRY_MS 5000      // Minimum gap between reconnect attempts on a dead link
+#define MUX_F_STRIPED 0x01     // OPEN: this stream's DATA frames are spread over every link
+#define MUX_F_COMPRESS 0x02    // OPEN: both directions may send LZ4-compressed DATA
+#define MUX_F_LZ4 0x04         // DATA: payload is one LZ4 block
+#define LZ4_HASH_LOG 12
+#define LZ4_MIN_SAVING 10      // Percent a block must shrink by to be sent compressed
+#define LZ4_MAX_BYPASS 256     // Longest run of blocks sent raw before probing again
+#define MIRROR_QUEUE_SLOTS 256 // Chunks buffered for the mirror before dropping (2 MB)
+#define MIRROR_RETRY_MS 5000   // Back-off after the mirror refuses a connection
+#define MIRROR_CONNECT_MS 1000 // The mirror thread serves every connection, so its connects are kept short
+#define CAPTURE_RING_SLOTS 1024 // Records buffered for the capture writer (power of two, 8 MB)
+#define RECORD_RING_SLOTS 1024  // Records buffered for the recorder's writer
+#define WRITER_FLUSH_MS 1000   // How often capture/record files are flushed while idle
+#define RECORD_MAGIC 0x43524650  // "PFRC" at the start of a recording
+#define RECORD_F_PAYLOAD 0x01  // Recording holds the relayed bytes, not just their sizes
+#define CONTROL_MAX_CLIENTS 8  // Simultaneous control socket connections
+#define ACCESS_RING_SLOTS 256  // Close records buffered for the access log writer
+#define ACCESS_LOG_MAGIC 0x4C414650  // "PFAL" at the start of an access log
+#define ACCESS_MAX_BACKENDS 64
+#define ACCESS_F_TLS 0x01      // Client leg was TLS
+#define ACCESS_F_TUNNEL 0x02   // Connection was a peer tunnel stream
+#define PROFILE_FLUSH_EVENTS 64 // Timed events a thread batches before folding them into the totals
+#define PROFILE_BUCKETS 48     // Power-of-two cycle buckets for sampled stage timings
+#define DEFAULT_BACKLOG 200    // What SOMAXCONN gives on most Windows editions
+#define BACKLOG_WARN_SECONDS 5 // Queue nonempty this many samples in a row = accept loop falling behind
+#define BACKLOG_WARN_INTERVAL_MS 10000
+#define KEEPALIVE_MAX_SECONDS 2147483  // SIO_KEEPALIVE_VALS takes milliseconds in a 32-bit field
+#define BUSY_POLL_MAX_WORKERS 64
+#define MAX_PRIORITY_IPS 16
+#define MAX_BACKENDS 16
+#define EWMA_DECAY_US 10000000.0  // Time constant of the backend latency averages (10 s)
+#define EWMA_FAILURE_US 1000000   // A failed connect counts as a 1 s sample
+#define WARMUP_MIN_SHARE 0.05     // Effective weight a backend starts its warm-up with
+#define MAGLEV_TABLE_SIZE 65537   // Slots in the client hash table (prime, well above 100 x MAX_BACKENDS)
+#define ADDR_TEXT_LEN (INET6_ADDRSTRLEN + 8)  // "[address]:port"
+#define STATS_LINE_SIZE 16384    // format_stats() output: ~230 bytes per backend x MAX_BACKENDS plus every close reason
+#define RATE_LIMIT_SLICE_MS 50    // Longest a rate-limited stream sleeps before re-checking kill/shutdown
+#define CONN_MEMORY_BASE 65536   // Rough committed cost of a relayed connection: thread stack and buffers
+
+// Peer tunnel roles
+enum { PEER_NONE, PEER_ENTRY, PEER_EXIT };
+
+// Relay socket options applied by configure_socket()
+enum {
+    SOCKOPT_BLOCKING = 0x01, SOCKOPT_TIMEOUTS = 0x02, SOCKOPT_NODELAY = 0x04,
+    SOCKOPT_KEEPALIVE = 0x08, SOCKOPT_KEEPALIVE_VALS = 0x10, SOCKOPT_ALL = 0x1F
+};
+
+// An IP address parsed once at startup and compared in binary against clients
+typedef struct {
+    int family;                // AF_INET or AF_INET6
+    unsigned char bytes[16];
+} ip_addr_t;
+
+// Circuit breaker states
+enum { BREAKER_CLOSED, BREAKER_OPEN, BREAKER_HALF_OPEN };
+
+const char* breaker_state_names[3] = { "closed", "open", "half_open" };
+
+// How a new connection's backend is chosen when there are several
+enum { BALANCE_P2C, BALANCE_ROUND_ROBIN, BALANCE_HASH, BALANCE_COUNT };
+
+const char* balance_names[BALANCE_COUNT] = { "p2c", "round-robin", "hash" };
+
+// An upstream the forwarder relays to, with its circuit breaker
+typedef struct {
+    const char* host;
+    int port;
+    char label[300];               // "host:port" for display and the access log
+    CRITICAL_SECTION lock;         // Guards breaker transitions; the closed state is read without it
+    volatile LONG state;           // BREAKER_*
+    int failures;                  // Consecutive connect failures
+    int probes;                    // Trial connects in flight while half-open
+    ULONGLONG opened_at;           // GetTickCount64() when the breaker last opened
+    volatile LONG64 opens;
+    volatile LONG64 fast_fails;    // Clients failed without a connect attempt
+    volatile LONG active;          // Connections currently relayed to it
+    volatile LONG64 picks;         // Connections the balancer sent here
+    LONG64 ewma_connect_us;        // Peak-EWMA of connect time; updated under lock
+    LONG64 ewma_connect_at;        // now_us() of the last connect sample
+    LONG64 ewma_ttfb_us;           // Peak-EWMA of time to the backend's first response byte
+    LONG64 ewma_ttfb_at;
+    volatile ULONGLONG warm_start; // GetTickCount64() when it came back; 0 once fully warm
+    volatile LONG down;            // Taken out of rotation through the control socket
+    double rr_current;             // Smooth weighted round-robin credit; guarded by balance_lock
+} backend_t;
+
+// Legs a socket can belong to, each with its own keepalive profile
+enum { LEG_CLIENT, LEG_REMOTE, LEG_PEER, LEG_COUNT };
+
+// Keepalive settings for one leg
+typedef struct {
+    int enabled;
+    int idle;          // Seconds without traffic before the first probe
+    int interval;      // Seconds between unanswered probes
+    int count;         // Unanswered probes before the connection is dropped (0 = system default, 10)
+    int user_timeout;  // Seconds unacknowledged data may wait before dropping (TCP_MAXRT; 0 = default)
+} keepalive_profile_t;
+
+// Peer tunnel frame types
+enum { MUX_HELLO = 1, MUX_OPEN, MUX_DATA, MUX_WINDOW_UPDATE, MUX_CLOSE };
+
+// Long-lived TCP connection to the peer forwarder carrying many streams
+typedef struct {
+    SOCKET socket;
+    CRITICAL_SECTION send_lock;  // Keeps each frame contiguous on the wire
+    HANDLE reader_handle;
+    volatile LONG up;
+    volatile LONG streams;       // Streams whose home is this link
+    int in_use;
+    ULONGLONG last_attempt;
+    ULONGLONG session_id;        // Links from the same entry forwarder share a session
+    int window;                  // Per-stream window negotiated in HELLO
+    struct sockaddr_storage peer_addr;  // Exit side: where an accepted link came from
+} mux_link_t;
+
+// Out-of-order DATA frame of a striped stream, waiting for the gap before it
+typedef struct mux_chunk_s {
+    struct mux_chunk_s* next;
+    unsigned int seq;
+    int len;
+    char data[1];
+} mux_chunk_t;
+
+// Schannel credential; the server session cache is tied to it, so rotating
+// the credential also retires every cached session and ticket key
+typedef struct {
+    CredHandle handle;
+    volatile LONG refs;
+} tls_cred_t;
+
+// Per-connection TLS state for the client leg
+typedef struct {
+    tls_cred_t* cred;
+    CtxtHandle context;
+    int context_valid;
+    SecPkgContext_StreamSizes sizes;
+    char* in_buf;       // Encrypted bytes received from the client, not yet decrypted
+    int in_len;
+    char* plain_buf;    // Decrypted bytes not yet forwarded to the remote
+    int plain_len;
+    int plain_off;
+    char* out_buf;      // Scratch buffer for outgoing records
+} tls_session_t;
+
+// Mirror queue entry types
+enum { MIRROR_DATA, MIRROR_CLOSE };
+
+// Chunk of client->remote traffic queued for the mirror
+typedef struct {
+    int slot;
+    unsigned long long id;
+    int type;
+    int len;
+    char data[BUFFER_SIZE];
+} mirror_entry_t;
+
+// Mirror thread's connection for one slot
+typedef struct {
+    SOCKET socket;
+    unsigned long long id;  // Connection being mirrored (0 = none)
+} mirror_target_t;
+
+// One record in a record_ring_t; seq tells producers and the consumer whose turn it is.
+// A ring's slots are only as long as its largest record: data is cut to the
+// ring's data_cap, so small fixed-size records don't each carry a full buffer.
+typedef struct {
+    volatile LONG64 seq;
+    unsigned long long id;
+    LONG64 time_us;     // Microseconds since the Unix epoch
+    LONG64 offset;      // Byte position of data in its direction of the connection
+    int slot;
+    int type;
+    int len;
+    char data[BUFFER_SIZE];
+} ring_slot_t;
+
+// Bounded lock-free ring: any relay thread pushes, a single writer thread drains.
+// Producers never wait; when the writer falls behind, records are dropped.
+typedef struct {
+    char* slots;                   // count slots of slot_size bytes each
+    int slot_size;
+    int data_cap;                  // Bytes of data a slot holds (at most BUFFER_SIZE)
+    LONG64 mask;
+    volatile LONG64 head;          // Next position a producer claims
+    char pad[64];                  // Keep producers and the consumer off one cache line
+    LONG64 tail;                   // Next position the consumer reads
+    volatile LONG64 drops;
+} record_ring_t;
+
+// A record_ring_t drained into a file by its own writer thread
+typedef struct {
+    record_ring_t ring;
+    FILE* file;                        // NULL when this writer is off
+    void (*write)(ring_slot_t* rec);   // Serializes one record; runs on the writer thread
+    HANDLE handle;
+} ring_writer_t;
+
+// Relay events seen by the capture and the recorder; IN is from the relayed socket's peer
+enum { RELAY_OPEN, RELAY_IN, RELAY_OUT, RELAY_CLOSE };
+
+// Why a connection ended: which side, during which operation, and what happened.
+// Packed into one byte as side << 6 | op << 4 | kind; 0 means not yet known.
+enum { CLOSE_SIDE_NONE, CLOSE_SIDE_CLIENT, CLOSE_SIDE_REMOTE, CLOSE_SIDE_PEER };
+enum { CLOSE_OP_NONE, CLOSE_OP_RECV, CLOSE_OP_SEND, CLOSE_OP_SETUP };
+enum {
+    CLOSE_UNKNOWN, CLOSE_EOF, CLOSE_RESET, CLOSE_ABORTED, CLOSE_NETRESET, CLOSE_TIMEOUT,
+    CLOSE_REFUSED, CLOSE_TLS, CLOSE_IDLE, CLOSE_KILLED, CLOSE_SHUTDOWN, CLOSE_ERROR, CLOSE_BREAKER,
+    CLOSE_KIND_COUNT
+};
+#define CLOSE_REASON(side, op, kind) (((side) << 6) | ((op) << 4) | (kind))
+
+const char* close_side_names[4] = { "", "client_", "remote_", "peer_" };
+const char* close_op_names[4] = { "", "recv_", "send_", "setup_" };
+const char* close_kind_names[CLOSE_KIND_COUNT] = {
+    "unknown", "eof", "reset", "aborted", "netreset", "timeout",
+    "refused", "tls", "idle", "killed", "shutdown", "error", "breaker"
+};
+
+// Stages timed by --profile
+enum { STAGE_ACCEPT, STAGE_DNS, STAGE_CONNECT, STAGE_TLS, STAGE_RELAY, STAGE_LOG, STAGE_COUNT };
+
+const char* stage_names[STAGE_COUNT] = { "accept", "dns", "connect", "tls", "relay", "log" };
+
+// A thread's stage totals not yet folded into stat_stage_*
+typedef struct {
+    unsigned long long cycles[STAGE_COUNT];
+    unsigned long long calls[STAGE_COUNT];
+    unsigned long long last_flush;   // TSC when this thread last folded its totals
+    unsigned int pending;            // Events since then
+    unsigned int tick;               // Counts events for --profile-sample
+} profile_local_t;
+
+// One access log entry, written as-is (little-endian, 64 bytes)
+typedef struct {
+    unsigned long long id;
+    LONG64 start_us;             // Microseconds since the Unix epoch
+    unsigned long long bytes_in; // Client -> remote
+    unsigned long long bytes_out;
+    unsigned int duration_ms;
+    unsigned int close_error;    // Winsock error behind the close, 0 if none
+    unsigned short client_port;
+    unsigned short backend;      // Index into the header's backend names
+    unsigned char family;        // 4, 6, or 0 for streams accepted from a peer forwarder
+    unsigned char close_reason;
+    unsigned char flags;
+    unsigned char reserved;
+    unsigned char client_addr[16];
+} access_record_t;
+
+// Capture writer's view of one connection, as a synthesized TCP flow
+typedef struct {
+    unsigned long long id;         // Connection being captured (0 = none)
+    struct sockaddr_storage peer;  // The captured socket's peer (normally the client)
+    struct sockaddr_storage local;
+    unsigned int peer_isn;         // Synthesized initial sequence number in each direction
+    unsigned int local_isn;
+    unsigned int peer_seq;         // Next TCP sequence number in each direction
+    unsigned int local_seq;
+} capture_flow_t;
+
+typedef struct {
+    SOCKET client_socket;
+    SOCKET remote_socket;
+    HANDLE thread_handle;
+    int active;
+    unsigned long long id;   // Unique per connection, never reused
+    int mirror_broken;       // A chunk was dropped; stop mirroring this connection
+    int capture;             // Relayed payloads go to the capture file
+    int record;              // Relay events go to the recording
+    unsigned long long capture_in;   // Bytes relayed from / to the captured socket's peer,
+    unsigned long long capture_out;  // including any the capture ring dropped
+    unsigned long long bytes_client_to_remote;
+    unsigned long long bytes_remote_to_client;
+    struct sockaddr_storage client_addr;  // As accepted (IPv4 unmapped); zero for streams from a peer forwarder
+    backend_t* backend;               // Where this connection is relayed to
+    LONG64 ttfb_from_us;              // When the backend was last waited on (connect or request); 0 once sampled
+    ULONGLONG started;                // GetTickCount64() when the slot was taken
+    LONG64 started_us;                // Wall-clock start for the access log
+    volatile LONG close_reason;       // CLOSE_REASON(); the first cause recorded wins
+    int close_error;                  // Winsock error that ended it, 0 if none
+    volatile ULONGLONG last_activity; // GetTickCount64() of the last relayed chunk
+    volatile int kill_requested;      // Set by the control socket; the relay thread closes up
+    volatile LONG rate_limit;         // Bytes/sec in each direction (0 = unlimited)
+    double rate_due[2];               // When each direction may next send, for rate_limit
+    tls_session_t* tls;  // NULL when the listener is plain TCP
+
+    // Peer tunnel stream state (peer modes only)
+    mux_link_t* link;              // Home link: carries OPEN, WINDOW_UPDATE and CLOSE
+    ULONGLONG session_id;
+    unsigned int stream_id;
+    int striped;                   // DATA frames are spread over every link in the session
+    volatile int peer_known;       // The peer has the stream, so striped DATA may leave the home link
+    CRITICAL_SECTION stream_lock;  // Guards the receive ring, send window and stream identity
+    HANDLE rx_event;               // Data or close arrived from the peer
+    HANDLE tx_event;               // Send window opened or stream closed
+    HANDLE down_handle;            // Thread draining the receive ring to the local socket
+    char* rx_buf;                  // Ring of data received from the peer (rx_cap bytes)
+    int rx_cap;
+    int rx_window;
+    int rx_start;
+    int rx_len;
+    int send_window;
+    unsigned int tx_seq;           // Next DATA sequence number to send
+    unsigned int rx_seq;           // Next DATA sequence number to deliver
+    mux_chunk_t* rx_pending;       // Striped frames that arrived ahead of rx_seq, sorted
+    int rx_pending_bytes;
+    int stripe_next;               // Round-robin position over the session's links
+    int compress;                  // Try LZ4 on outgoing DATA
+    int lz4_skip;                  // Blocks left to send raw after a poor ratio
+    int lz4_backoff;               // Next bypass length; doubles while data stays incompressible
+    int close_pending;             // CLOSE arrived before all striped DATA did
+    unsigned int close_seq;        // Sequence number the peer's CLOSE follows
+    volatile int peer_closed;
+    volatile int closing;
+} connection_t;
+
+// Global variables for cleanup
+connection_t connections[MAX_CONNECTIONS];
+SOCKET listen_socket = INVALID_SOCKET;
+volatile int running = 1;
+CRITICAL_SECTION conn_lock;
+char* allowed_ip = NULL;  // NULL means allow all IPs
+ip_addr_t allowed_addr;   // allowed_ip, parsed
+int verbose_mode = 0;     // Verbose mode for IP filtering (default: off)
+char* tls_cert_subject = NULL;  // NULL means plain TCP on the listener
+int tls_enabled = 0;
+int tls_session_lifetime = 0;   // Seconds a session stays resumable (0 = Schannel default)
+int tls_rotate_interval = 0;    // Seconds between credential rotations (0 = never)
+tls_cred_t* tls_current_cred = NULL;
+CRITICAL_SECTION tls_cred_lock;
+ULONGLONG tls_last_rotation = 0;
+HCERTSTORE tls_cert_store = NULL;
+PCCERT_CONTEXT tls_cert = NULL;
+int peer_mode = PEER_NONE;
+int peer_link_count = 2;        // Links the entry side keeps open to the exit side
+int peer_stripe = 0;            // Entry side: stripe each stream across all links
+int peer_compress = 0;          // Entry side: LZ4-compress stream data on the peer links
+int mux_window = MUX_DEFAULT_WINDOW;
+ULONGLONG mux_session_id = 0;   // Entry side: identifies our links to the exit side
+mux_link_t mux_links[MUX_MAX_LINKS];
+HANDLE mux_redial_handle = NULL;  // Entry side: reconnects dead links off the accept thread
+volatile LONG mux_next_stream_id = 0;
+char* mirror_host = NULL;       // NULL means no mirroring
+int mirror_port = 0;
+mirror_entry_t* mirror_queue = NULL;
+int mirror_head = 0;
+int mirror_count = 0;
+CRITICAL_SECTION mirror_lock;
+HANDLE mirror_event = NULL;
+HANDLE mirror_handle = NULL;
+mirror_target_t mirror_targets[MAX_CONNECTIONS];
+volatile LONG64 next_connection_id = 0;
+char* capture_path = NULL;      // NULL means no capture
+char* capture_filter = NULL;    // Only capture connections whose peer has this IP
+ip_addr_t capture_filter_addr;
+ring_writer_t capture_writer;
+capture_flow_t capture_flows[MAX_CONNECTIONS];
+char* record_path = NULL;       // NULL means no recording
+int record_payloads = 0;        // Also record the relayed bytes
+ring_writer_t record_writer;
+LONG64 record_start_us = 0;
+char* access_log_path = NULL;   // NULL means no access log
+ring_writer_t access_writer;
+volatile int writers_running = 1;  // Cleared once no relay thread can add records
+int stats_interval = 0;         // Seconds between periodic stats lines (0 = only at shutdown)
+HANDLE maintenance_handle = NULL;
+int top_mode = 0;               // Redraw a live connection table every second
+FILE* top_out = NULL;           // The console, even when stdout is silenced for --top
+backend_t backends[MAX_BACKENDS];  // Where connections are relayed to (the peer forwarder on the entry side)
+int backend_count = 0;
+int breaker_threshold = 0;      // Consecutive connect failures that open a backend's breaker (0 = no breaker)
+int breaker_cooldown = 10;      // Seconds a breaker stays open before letting probes through
+int breaker_probes = 1;         // Concurrent trial connects while half-open
+int connect_timeout_ms = 0;     // Per-attempt limit for outgoing connects (0 = system default)
+int connect_budget_ms = 0;      // Time a client's upstream connect may take over all attempts (0 = unlimited)
+int connect_retries = -1;       // Extra backends tried after a failed connect (-1 = one per other backend, max 3)
+int primary_count = 1;          // backends[0..primary_count) take new connections; the rest are fallbacks
+volatile LONG64 stat_connect_retries = 0;
+volatile LONG64 stat_connect_rescued = 0;  // Clients connected by a retry after a failed attempt
+int balance_policy = BALANCE_P2C;
+CRITICAL_SECTION balance_lock;  // Guards round-robin credits
+int warmup_seconds = 0;         // Ramp a recovered backend's weight up over this long (0 = at once)
+unsigned char maglev_table[MAGLEV_TABLE_SIZE];  // Client hash slot -> backend index
+double hash_load_factor = 1.25; // A backend takes at most this multiple of the average load
+volatile LONG64 stat_hash_spills = 0;  // Clients sent past their own backend by the load bound
+__declspec(thread) unsigned int balance_seed;  // Per-thread xorshift state for P2C
+char* control_path = NULL;      // NULL means no control socket
+SOCKET control_socket = INVALID_SOCKET;
+HANDLE control_handle = NULL;
+int idle_timeout = 0;           // Seconds without traffic before a connection is closed (0 = never)
+volatile int draining = 0;      // Refuse new clients; existing ones finish normally
+volatile LONG default_rate_limit = 0;  // Bytes/sec applied to new connections (0 = unlimited)
+int listen_port = 0;
+int listen_family = AF_INET6;   // AF_INET6 = dual-stack listener, AF_INET with --ipv4-only
+int listen_backlog = 0;         // Requested accept queue length (0 = SOMAXCONN)
+struct sockaddr_storage accept_current;  // Client the accept loop is handling, not yet in connections[]
+volatile int accept_busy = 0;
+int listener_inherited = 0;     // SOCKOPT_* accepted sockets already carry from the listener
+keepalive_profile_t keepalive_profiles[LEG_COUNT] = {  // Client, remote, peer link: 10s then every 1s
+    { 1, 10, 1, 0, 0 }, { 1, 10, 1, 0, 0 }, { 1, 10, 1, 0, 0 }
+};
+const char* leg_names[LEG_COUNT] = { "client", "remote", "peer" };
+int keepalive_configured = 0;   // A --keepalive-* option was given
+int busy_poll_us = 0;           // Spin this long after the last chunk before sleeping in select() (0 = off)
+int busy_poll_workers = 1;      // Connections that may spin at once
+int busy_poll_cpu = -1;         // Pin spinning worker k to CPU busy_poll_cpu + k (-1 = don't pin)
+volatile LONG64 busy_poll_slots = 0;  // Bit k set = worker slot k taken
+int admit_limit = MAX_CONNECTIONS;     // Connections admitted before shedding
+long long memory_budget = 0;    // Bytes connections may be estimated to use (0 = no budget)
+int socket_budget = 0;          // Sockets connections may hold open (0 = no budget)
+ip_addr_t priority_ips[MAX_PRIORITY_IPS];  // Sources that may use the reserved headroom
+int priority_ip_count = 0;
+int priority_reserve = -1;      // Headroom only priority sources may use (-1 = 10% when any are set)
+int profile_enabled = 0;        // Time stages with the TSC
+int profile_sample = 0;         // Also histogram 1 in N timed events (0 = no sampling)
+double profile_tsc_per_us = 1.0;
+__declspec(thread) profile_local_t profile_local;
+
+// ETW provider for the lifecycle tracepoints. The GUID is the standard hash of
+// the name, so tools can also enable it as *PortForwarder. Each event costs one
+// check of the provider's enable flag until a trace session turns it on; build
+// with PF_NO_TRACE to compile the tracepoints out entirely.
+#ifndef PF_NO_TRACE
+TRACELOGGING_DEFINE_PROVIDER(trace_provider, "PortForwarder",
+    (0x844ebf22, 0x7895, 0x5532, 0xda, 0x90, 0x9e, 0x78, 0x8c, 0x0e, 0xea, 0xfb));
+#define TRACE_ENABLED() TraceLoggingProviderEnabled(trace_provider, 0, 0)
+#define TRACE_EVENT(...) TraceLoggingWrite(trace_provider, __VA_ARGS__)
+#define TRACE_REGISTER() TraceLoggingRegister(trace_provider)
+#define TRACE_UNREGISTER() TraceLoggingUnregister(trace_provider)
+#else
+#define TRACE_ENABLED() 0
+#define TRACE_EVENT(...) ((void)0)
+#define TRACE_REGISTER() ((void)0)
+#define TRACE_UNREGISTER() ((void)0)
+#endif
+
+// Counters reported by format_stats()
+volatile LONG64 stat_tls_full_handshakes = 0;
+volatile LONG64 stat_tls_resumed_handshakes = 0;
+volatile LONG64 stat_tls_failed_handshakes = 0;
+volatile LONG64 stat_tls_rotations = 0;
+volatile LONG64 stat_mux_streams = 0;
+volatile LONG64 stat_lz4_raw_bytes = 0;     // Payload offered to the compressor
+volatile LONG64 stat_lz4_wire_bytes = 0;    // What was actually sent for it
+volatile LONG64 stat_lz4_bypassed = 0;      // Blocks sent raw (poor ratio or backing off)
+volatile LONG64 stat_mirror_bytes = 0;
+volatile LONG64 stat_mirror_drops = 0;      // Chunks not mirrored (queue full, mirror down or slow)
+volatile LONG64 stat_mirror_connect_failures = 0;
+volatile LONG64 stat_capture_packets = 0;
+volatile LONG64 stat_record_events = 0;
+volatile LONG64 stat_closes[256];           // Indexed by close reason byte
+volatile LONG64 stat_stage_cycles[STAGE_COUNT];
+volatile LONG64 stat_stage_calls[STAGE_COUNT];
+volatile LONG64 stat_stage_hist[STAGE_COUNT][PROFILE_BUCKETS];  // Sampled events by log2(cycles)
+int stat_accept_queue = -1;                 // Established, not yet accepted (-1 = not sampled yet)
+int stat_accept_queue_max = 0;
+int stat_syn_queue = 0;                     // Handshakes in progress on the listen port
+LONG64 stat_tcp_attempt_fails = 0;          // System-wide failed connection attempts since startup
+volatile LONG64 stat_accepts = 0;           // Sockets returned by accept(), rejected ones included
+volatile LONG64 stat_setup_syscalls = 0;    // select/accept in the accept loop plus relay socket setup
+volatile LONG64 stat_shed = 0;              // Clients turned away by admission control
+volatile LONG64 stat_busy_poll_hits = 0;    // Data found while spinning
+volatile LONG64 stat_busy_poll_sleeps = 0;  // Spins that ran out and fell back to sleeping
+volatile LONG64 stat_busy_poll_cycles = 0;  // TSC cycles spent spinning
+
+// Forward declarations
+void cleanup();
+BOOL WINAPI console_handler(DWORD signal);
+
+// Error handling function
+void print_error(const char* msg) {
+    fprintf(stderr, "[ERROR] %s: %d\n", msg, WSAGetLastError());
+}
+
+// Parse an IPv4 or IPv6 address; a V4-mapped IPv6 address is kept as IPv4
+int parse_ip(const char* text, ip_addr_t* ip) {
+    struct in6_addr v6;
+
+    ZeroMemory(ip, sizeof(*ip));
+    if (inet_pton(AF_INET, text, ip->bytes) == 1) {
+        ip->family = AF_INET;
+        return 0;
+    }
+    if (inet_pton(AF_INET6, text, &v6) != 1) {
+        return -1;
+    }
+    if (IN6_IS_ADDR_V4MAPPED(&v6)) {
+        ip->family = AF_INET;
+        memcpy(ip->bytes, v6.s6_addr + 12, 4);
+    }
+    else {
+        ip->family = AF_INET6;
+        memcpy(ip->bytes, v6.s6_addr, 16);
+    }
+    return 0;
+}
+
+// A dual-stack listener reports IPv4 clients as ::ffff:a.b.c.d; store those
+// as plain IPv4 so filters, hashing and logs treat both listeners alike
+void addr_unmap(struct sockaddr_storage* addr) {
+    struct sockaddr_in6* v6 = (struct sockaddr_in6*)addr;
+    if (addr->ss_family == AF_INET6 && IN6_IS_ADDR_V4MAPPED(&v6->sin6_addr)) {
+        struct sockaddr_in v4;
+        ZeroMemory(&v4, sizeof(v4));
+        v4.sin_family = AF_INET;
+        v4.sin_port = v6->sin6_port;
+        memcpy(&v4.sin_addr, v6->sin6_addr.s6_addr + 12, 4);
+        ZeroMemory(addr, sizeof(*addr));
+        memcpy(addr, &v4, sizeof(v4));
+    }
+}
+
+// The address bytes of addr and their length (4 or 16); NULL for no address
+const unsigned char* addr_bytes(const struct sockaddr_storage* addr, int* len) {
+    if (addr->ss_family == AF_INET) {
+        *len = 4;
+        return (const unsigned char*)&((const struct sockaddr_in*)addr)->sin_addr;
+    }
+    if (addr->ss_family == AF_INET6) {
+        *len = 16;
+        return ((const struct sockaddr_in6*)addr)->sin6_addr.s6_addr;
+    }
+    *len = 0;
+    return NULL;
+}
+
+// Port of addr in network byte order
+u_short addr_port(const struct sockaddr_storage* addr) {
+    return addr->ss_family == AF_INET6 ? ((const struct sockaddr_in6*)addr)->sin6_port :
+        ((const struct sockaddr_in*)addr)->sin_port;
+}
+
+// Length of the sockaddr actually held in addr
+int addr_size(const struct sockaddr_storage* addr) {
+    return addr->ss_family == AF_INET6 ? (int)sizeof(struct sockaddr_in6) : (int)sizeof(struct sockaddr_in);
+}
+
+// Does addr hold the IP address ip?
+int ip_matches(const ip_addr_t* ip, const struct sockaddr_storage* addr) {
+    int len;
+    const unsigned char* bytes = addr_bytes(addr, &len);
+    return bytes != NULL && addr->ss_family == ip->family && memcmp(bytes, ip->bytes, len) == 0;
+}
+
+// Same address and port?
+int addr_equal(const struct sockaddr_storage* a, const struct sockaddr_storage* b) {
+    int len;
+    const unsigned char* a_bytes = addr_bytes(a, &len);
+    return a_bytes != NULL && a->ss_family == b->ss_family && addr_port(a) == addr_port(b) &&
+        memcmp(a_bytes, addr_bytes(b, &len), len) == 0;
+}
+
+// Format addr as "a.b.c.d:port" or "[v6]:port". Addresses stay binary until
+// a line that shows them is actually printed.
+void format_addr(char* buf, int len, const struct sockaddr_storage* addr) {
+    char ip[INET6_ADDRSTRLEN];
+    int ip_len;
+    const unsigned char* bytes = addr_bytes(addr, &ip_len);
+
+    if (bytes == NULL) {
+        snprintf(buf, len, "-");
+        return;
+    }
+    inet_ntop(addr->ss_family, bytes, ip, sizeof(ip));
+    snprintf(buf, len, addr->ss_family == AF_INET6 ? "[%s]:%d" : "%s:%d", ip, ntohs(addr_port(addr)));
+}
+
+// Check if IP is allowed
+int is_ip_allowed(const struct sockaddr_storage* client_addr) {
+    if (allowed_ip == NULL) {
+        return 1;  // No filter, allow all
+    }
+    return ip_matches(&allowed_addr, client_addr);
+}
+
+// Check if IP may use the headroom reserved for priority sources
+int is_priority_ip(const struct sockaddr_storage* client_addr) {
+    for (int i = 0; i < priority_ip_count; i++) {
+        if (ip_matches(&priority_ips[i], client_addr)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Send an entire buffer, retrying on partial sends
+int send_all(SOCKET s, const char* data, int len) {
+    int total_sent = 0;
+    while (total_sent < len) {
+        int bytes_sent = send(s, data + total_sent, len - total_sent, 0);
+        if (bytes_sent == SOCKET_ERROR) {
+            return SOCKET_ERROR;
+        }
+        total_sent += bytes_sent;
+    }
+    return total_sent;
+}
+
+// Acquire a Schannel credential for the loaded certificate
+tls_cred_t* tls_acquire_cred() {
+    tls_cred_t* tls_cred = (tls_cred_t*)calloc(1, sizeof(tls_cred_t));
+    if (tls_cred == NULL) {
+        return NULL;
+    }
+
+    SCHANNEL_CRED cred;
+    ZeroMemory(&cred, sizeof(cred));
+    cred.dwVersion = SCHANNEL_CRED_VERSION;
+    cred.cCreds = 1;
+    cred.paCred = &tls_cert;
+    cred.dwFlags = SCH_CRED_NO_SYSTEM_MAPPER | SCH_USE_STRONG_CRYPTO;
+    cred.dwSessionLifespan = (DWORD)tls_session_lifetime * 1000;
+
+    SECURITY_STATUS status = AcquireCredentialsHandleA(NULL, UNISP_NAME_A, SECPKG_CRED_INBOUND,
+        NULL, &cred, NULL, NULL, &tls_cred->handle, NULL);
+    if (status != SEC_E_OK) {
+        fprintf(stderr, "[ERROR] AcquireCredentialsHandle() failed: 0x%08lx\n", (unsigned long)status);
+        free(tls_cred);
+        return NULL;
+    }
+
+    tls_cred->refs = 1;
+    return tls_cred;
+}
+
+// Load the server certificate and acquire the Schannel credential
+int tls_init(const char* subject) {
+    DWORD locations[2] = { CERT_SYSTEM_STORE_LOCAL_MACHINE, CERT_SYSTEM_STORE_CURRENT_USER };
+
+    // Look in the machine store first, then the current user's store
+    for (int i = 0; i < 2 && tls_cert == NULL; i++) {
+        tls_cert_store = CertOpenStore(CERT_STORE_PROV_SYSTEM_A, 0, 0,
+            locations[i] | CERT_STORE_READONLY_FLAG | CERT_STORE_OPEN_EXISTING_FLAG, "MY");
+        if (tls_cert_store == NULL) {
+            continue;
+        }
+        tls_cert = CertFindCertificateInStore(tls_cert_store, X509_ASN_ENCODING | PKCS_7_ASN_ENCODING,
+            0, CERT_FIND_SUBJECT_STR_A, subject, NULL);
+        if (tls_cert == NULL) {
+            CertCloseStore(tls_cert_store, 0);
+            tls_cert_store = NULL;
+        }
+    }
+
+    if (tls_cert == NULL) {
+        fprintf(stderr, "[ERROR] No certificate matching \"%s\" in the MY store\n", subject);
+        return -1;
+    }
+
+    tls_current_cred = tls_acquire_cred();
+    if (tls_current_cred == NULL) {
+        CertFreeCertificateContext(tls_cert);
+        CertCloseStore(tls_cert_store, 0);
+        tls_cert = NULL;
+        tls_cert_store = NULL;
+        return -1;
+    }
+
+    InitializeCriticalSection(&tls_cred_lock);
+    tls_last_rotation = GetTickCount64();
+    tls_enabled = 1;
+    return 0;
+}
+
+// Drop a reference to a credential, freeing it (and its session cache) on the last one
+void tls_release_cred(tls_cred_t* cred) {
+    if (InterlockedDecrement(&cred->refs) == 0) {
+        FreeCredentialsHandle(&cred->handle);
+        free(cred);
+    }
+}
+
+// Swap in a fresh credential; sessions cached under the old one stop resuming
+void tls_rotate_cred() {
+    tls_cred_t* fresh = tls_acquire_cred();
+    if (fresh == NULL) {
+        return;  // Keep serving with the current credential
+    }
+
+    EnterCriticalSection(&tls_cred_lock);
+    tls_cred_t* old = tls_current_cred;
+    tls_current_cred = fresh;
+    LeaveCriticalSection(&tls_cred_lock);
+
+    tls_release_cred(old);
+    InterlockedIncrement64(&stat_tls_rotations);
+}
+
+// Release the credential and certificate
+void tls_free() {
+    if (!tls_enabled) {
+        return;
+    }
+    tls_release_cred(tls_current_cred);
+    tls_current_cred = NULL;
+    DeleteCriticalSection(&tls_cred_lock);
+    CertFreeCertificateContext(tls_cert);
+    CertCloseStore(tls_cert_store, 0);
+    tls_enabled = 0;
+}
+
+// Allocate per-connection TLS state (one block for all three buffers)
+tls_session_t* tls_session_create() {
+    tls_session_t* tls = (tls_session_t*)calloc(1, sizeof(tls_session_t) + 3 * TLS_BUFFER_SIZE);
+    if (tls == NULL) {
+        return NULL;
+    }
+    tls->in_buf = (char*)(tls + 1);
+    tls->plain_buf = tls->in_buf + TLS_BUFFER_SIZE;
+    tls->out_buf = tls->plain_buf + TLS_BUFFER_SIZE;
+
+    // Pin the current credential so a rotation can't free it mid-handshake
+    EnterCriticalSection(&tls_cred_lock);
+    tls->cred = tls_current_cred;
+    InterlockedIncrement(&tls->cred->refs);
+    LeaveCriticalSection(&tls_cred_lock);
+    return tls;
+}
+
+// Run the server side of the TLS handshake on a blocking socket
+int tls_accept(tls_session_t* tls, SOCKET s) {
+    SecBuffer in_buffers[2], out_buffers[1];
+    SecBufferDesc in_desc, out_desc;
+    ULONG req_flags = ASC_REQ_SEQUENCE_DETECT | ASC_REQ_REPLAY_DETECT | ASC_REQ_CONFIDENTIALITY |
+        ASC_REQ_EXTENDED_ERROR | ASC_REQ_ALLOCATE_MEMORY | ASC_REQ_STREAM;
+    ULONG ret_flags;
+    SECURITY_STATUS status = SEC_I_CONTINUE_NEEDED;
+    int need_more = 1;
+
+    while (status == SEC_I_CONTINUE_NEEDED || status == SEC_E_INCOMPLETE_MESSAGE) {
+        if (need_more) {
+            if (tls->in_len == TLS_BUFFER_SIZE) {
+                fprintf(stderr, "[ERROR] TLS handshake message too large\n");
+                return -1;
+            }
+            int n = recv(s, tls->in_buf + tls->in_len, TLS_BUFFER_SIZE - tls->in_len, 0);
+            if (n <= 0) {
+                fprintf(stderr, "[ERROR] TLS handshake aborted by client: %d\n", n == 0 ? 0 : WSAGetLastError());
+                InterlockedIncrement64(&stat_tls_failed_handshakes);
+                return -1;
+            }
+            tls->in_len += n;
+        }
+
+        in_buffers[0].BufferType = SECBUFFER_TOKEN;
+        in_buffers[0].pvBuffer = tls->in_buf;
+        in_buffers[0].cbBuffer = tls->in_len;
+        in_buffers[1].BufferType = SECBUFFER_EMPTY;
+        in_buffers[1].pvBuffer = NULL;
+        in_buffers[1].cbBuffer = 0;
+        in_desc.ulVersion = SECBUFFER_VERSION;
+        in_desc.cBuffers = 2;
+        in_desc.pBuffers = in_buffers;
+
+        out_buffers[0].BufferType = SECBUFFER_TOKEN;
+        out_buffers[0].pvBuffer = NULL;
+        out_buffers[0].cbBuffer = 0;
+        out_desc.ulVersion = SECBUFFER_VERSION;
+        out_desc.cBuffers = 1;
+        out_desc.pBuffers = out_buffers;
+
+        status = AcceptSecurityContext(&tls->cred->handle, tls->context_valid ? &tls->context : NULL,
+            &in_desc, req_flags, SECURITY_NATIVE_DREP, &tls->context, &out_desc, &ret_flags, NULL);
+
+        if (status == SEC_E_INCOMPLETE_MESSAGE) {
+            need_more = 1;
+            continue;
+        }
+        tls->context_valid = 1;
+
+        // Send any handshake token produced, even on failure (it may carry an alert)
+        if (out_buffers[0].cbBuffer > 0 && out_buffers[0].pvBuffer != NULL) {
+            int sent = send_all(s, (const char*)out_buffers[0].pvBuffer, (int)out_buffers[0].cbBuffer);
+            FreeContextBuffer(out_buffers[0].pvBuffer);
+            if (sent == SOCKET_ERROR) {
+                print_error("send() of TLS handshake failed");
+                return -1;
+            }
+        }
+
+        if (status != SEC_E_OK && status != SEC_I_CONTINUE_NEEDED) {
+            fprintf(stderr, "[ERROR] TLS handshake failed: 0x%08lx\n", (unsigned long)status);
+            InterlockedIncrement64(&stat_tls_failed_handshakes);
+            return -1;
+        }
+
+        // Keep unconsumed bytes (next handshake message or early application data)
+        if (in_buffers[1].BufferType == SECBUFFER_EXTRA && in_buffers[1].cbBuffer > 0) {
+            memmove(tls->in_buf, tls->in_buf + (tls->in_len - in_buffers[1].cbBuffer), in_buffers[1].cbBuffer);
+            tls->in_len = in_buffers[1].cbBuffer;
+            need_more = 0;
+        }
+        else {
+            tls->in_len = 0;
+            need_more = 1;
+        }
+    }
+
+    // Count abbreviated (resumed) handshakes separately from full ones
+    SecPkgContext_SessionInfo session_info;
+    if (QueryContextAttributes(&tls->context, SECPKG_ATTR_SESSION_INFO, &session_info) == SEC_E_OK &&
+        (session_info.dwFlags & SSL_SESSION_RECONNECT)) {
+        InterlockedIncrement64(&stat_tls_resumed_handshakes);
+    }
+    else {
+        InterlockedIncrement64(&stat_tls_full_handshakes);
+    }
+
+    status = QueryContextAttributes(&tls->context, SECPKG_ATTR_STREAM_SIZES, &tls->sizes);
+    if (status != SEC_E_OK) {
+        fprintf(stderr, "[ERROR] QueryContextAttributes() failed: 0x%08lx\n", (unsigned long)status);
+        return -1;
+    }
+    if (tls->sizes.cbHeader + tls->sizes.cbMaximumMessage + tls->sizes.cbTrailer > TLS_BUFFER_SIZE) {
+        tls->sizes.cbMaximumMessage = TLS_BUFFER_SIZE - tls->sizes.cbHeader - tls->sizes.cbTrailer;
+    }
+    return 0;
+}
+
+// Check whether a complete record (or decrypted data) is buffered, so select() would miss it
+int tls_pending(tls_session_t* tls) {
+    if (tls->plain_off < tls->plain_len) {
+        return 1;
+    }
+    if (tls->in_len >= 5) {
+        int record_len = ((unsigned char)tls->in_buf[3] << 8) | (unsigned char)tls->in_buf[4];
+        return tls->in_len >= 5 + record_len;
+    }
+    return 0;
+}
+
+// Receive decrypted application data; same return convention as recv() on a
+// non-blocking socket. The socket is read at most once, and only if select()
+// found it readable: a partial record stays buffered and the call fails with
+// WSAEWOULDBLOCK, so a client trickling in a record can't hold up the relay.
+int tls_recv(tls_session_t* tls, SOCKET s, int readable, char* buf, int len) {
+    while (tls->plain_off >= tls->plain_len) {
+        if (tls->in_len > 0) {
+            SecBuffer buffers[4];
+            SecBufferDesc desc;
+
+            buffers[0].BufferType = SECBUFFER_DATA;
+            buffers[0].pvBuffer = tls->in_buf;
+            buffers[0].cbBuffer = tls->in_len;
+            for (int i = 1; i < 4; i++) {
+                buffers[i].BufferType = SECBUFFER_EMPTY;
+                buffers[i].pvBuffer = NULL;
+                buffers[i].cbBuffer = 0;
+            }
+            desc.ulVersion = SECBUFFER_VERSION;
+            desc.cBuffers = 4;
+            desc.pBuffers = buffers;
+
+            SECURITY_STATUS status = DecryptMessage(&tls->context, &desc, 0, NULL);
+
+            if (status == SEC_E_OK) {
+                SecBuffer* data = NULL;
+                SecBuffer* extra = NULL;
+                for (int i = 1; i < 4; i++) {
+                    if (buffers[i].BufferType == SECBUFFER_DATA) data = &buffers[i];
+                    if (buffers[i].BufferType == SECBUFFER_EXTRA) extra = &buffers[i];
+                }
+
+                // Decryption is in place, so copy plaintext out before compacting
+                tls->plain_len = 0;
+                tls->plain_off = 0;
+                if (data != NULL && data->cbBuffer > 0) {
+                    memcpy(tls->plain_buf, data->pvBuffer, data->cbBuffer);
+                    tls->plain_len = data->cbBuffer;
+                }
+                if (extra != NULL && extra->cbBuffer > 0) {
+                    memmove(tls->in_buf, tls->in_buf + (tls->in_len - extra->cbBuffer), extra->cbBuffer);
+                    tls->in_len = extra->cbBuffer;
+                }
+                else {
+                    tls->in_len = 0;
+                }
+                continue;
+            }
+
+            if (status == SEC_I_CONTEXT_EXPIRED) {
+                return 0;  // close_notify from the client
+            }
+
+            if (status != SEC_E_INCOMPLETE_MESSAGE) {
+                if (status == SEC_I_RENEGOTIATE) {
+                    fprintf(stderr, "[ERROR] TLS renegotiation requested by client is not supported\n");
+                }
+                else {
+                    fprintf(stderr, "[ERROR] TLS DecryptMessage() failed: 0x%08lx\n", (unsigned long)status);
+                }
+                WSASetLastError(WSAECONNABORTED);
+                return SOCKET_ERROR;
+            }
+        }
+
+        if (!readable) {
+            WSASetLastError(WSAEWOULDBLOCK);
+            return SOCKET_ERROR;
+        }
+        if (tls->in_len == TLS_BUFFER_SIZE) {
+            fprintf(stderr, "[ERROR] TLS record too large\n");
+            WSASetLastError(WSAECONNABORTED);
+            return SOCKET_ERROR;
+        }
+
+        int n = recv(s, tls->in_buf + tls->in_len, TLS_BUFFER_SIZE - tls->in_len, 0);
+        if (n <= 0) {
+            return n;
+        }
+        tls->in_len += n;
+        readable = 0;
+    }
+
+    int available = tls->plain_len - tls->plain_off;
+    int n = available < len ? available : len;
+    memcpy(buf, tls->plain_buf + tls->plain_off, n);
+    tls->plain_off += n;
+    return n;
+}
+
+// Encrypt and send application data to the client; returns len or SOCKET_ERROR
+int tls_send(tls_session_t* tls, SOCKET s, const char* data, int len) {
+    int offset = 0;
+
+    while (offset < len) {
+        int chunk = len - offset;
+        if (chunk > (int)tls->sizes.cbMaximumMessage) {
+            chunk = (int)tls->sizes.cbMaximumMessage;
+        }
+
+        SecBuffer buffers[4];
+        SecBufferDesc desc;
+        char* header = tls->out_buf;
+        char* body = header + tls->sizes.cbHeader;
+
+        memcpy(body, data + offset, chunk);
+        buffers[0].BufferType = SECBUFFER_STREAM_HEADER;
+        buffers[0].pvBuffer = header;
+        buffers[0].cbBuffer = tls->sizes.cbHeader;
+        buffers[1].BufferType = SECBUFFER_DATA;
+        buffers[1].pvBuffer = body;
+        buffers[1].cbBuffer = chunk;
+        buffers[2].BufferType = SECBUFFER_STREAM_TRAILER;
+        buffers[2].pvBuffer = body + chunk;
+        buffers[2].cbBuffer = tls->sizes.cbTrailer;
+        buffers[3].BufferType = SECBUFFER_EMPTY;
+        buffers[3].pvBuffer = NULL;
+        buffers[3].cbBuffer = 0;
+        desc.ulVersion = SECBUFFER_VERSION;
+        desc.cBuffers = 4;
+        desc.pBuffers = buffers;
+
+        SECURITY_STATUS status = EncryptMessage(&tls->context, 0, &desc, 0);
+        if (status != SEC_E_OK) {
+            fprintf(stderr, "[ERROR] TLS EncryptMessage() failed: 0x%08lx\n", (unsigned long)status);
+            WSASetLastError(WSAECONNABORTED);
+            return SOCKET_ERROR;
+        }
+
+        int record_len = (int)(buffers[0].cbBuffer + buffers[1].cbBuffer + buffers[2].cbBuffer);
+        if (send_all(s, header, record_len) == SOCKET_ERROR) {
+            return SOCKET_ERROR;
+        }
+        offset += chunk;
+    }
+
+    return len;
+}
+
+// Send close_notify (best effort) and release the connection's TLS state
+void tls_session_close(tls_session_t* tls, SOCKET s) {
+    if (tls->context_valid) {
+        DWORD shutdown_token = SCHANNEL_SHUTDOWN;
+        SecBuffer buffer;
+        SecBufferDesc desc;
+
+        buffer.BufferType = SECBUFFER_TOKEN;
+        buffer.pvBuffer = &shutdown_token;
+        buffer.cbBuffer = sizeof(shutdown_token);
+        desc.ulVersion = SECBUFFER_VERSION;
+        desc.cBuffers = 1;
+        desc.pBuffers = &buffer;
+
+        if (ApplyControlToken(&tls->context, &desc) == SEC_E_OK) {
+            ULONG ret_flags;
+            buffer.BufferType = SECBUFFER_TOKEN;
+            buffer.pvBuffer = NULL;
+            buffer.cbBuffer = 0;
+            if (AcceptSecurityContext(&tls->cred->handle, &tls->context, NULL,
+                ASC_REQ_ALLOCATE_MEMORY | ASC_REQ_STREAM, SECURITY_NATIVE_DREP,
+                NULL, &desc, &ret_flags, NULL) == SEC_E_OK && buffer.pvBuffer != NULL) {
+                send_all(s, (const char*)buffer.pvBuffer, (int)buffer.cbBuffer);
+                FreeContextBuffer(buffer.pvBuffer);
+            }
+        }
+        DeleteSecurityContext(&tls->context);
+    }
+    tls_release_cred(tls->cred);
+    free(tls);
+}
+
+// Name a close reason, e.g. "client_recv_reset" or "idle"
+void format_close_reason(char* buf, int len, int reason) {
+    int kind = reason & 0x0F;
+    snprintf(buf, len, "%s%s%s", close_side_names[(reason >> 6) & 3], close_op_names[(reason >> 4) & 3],
+        kind < CLOSE_KIND_COUNT ? close_kind_names[kind] : "unknown");
+}
+
+// Map a Winsock error (0 = orderly EOF, -1 = failed fast by a circuit breaker) to a close kind
+int close_kind(int error) {
+    switch (error) {
+    case -1: return CLOSE_BREAKER;
+    case 0: return CLOSE_EOF;
+    case WSAECONNRESET: return CLOSE_RESET;
+    case WSAECONNABORTED: return CLOSE_ABORTED;
+    case WSAENETRESET: return CLOSE_NETRESET;
+    case WSAETIMEDOUT: return CLOSE_TIMEOUT;
+    case WSAECONNREFUSED: return CLOSE_REFUSED;
+    default: return CLOSE_ERROR;
+    }
+}
+
+// Start timing a stage; returns 0 when profiling is off
+unsigned long long profile_begin() {
+    return profile_enabled ? __rdtsc() : 0;
+}
+
+// Fold this thread's stage totals into the shared counters
+void profile_flush() {
+    for (int i = 0; i < STAGE_COUNT; i++) {
+        if (profile_local.calls[i] != 0) {
+            InterlockedAdd64(&stat_stage_cycles[i], (LONG64)profile_local.cycles[i]);
+            InterlockedAdd64(&stat_stage_calls[i], (LONG64)profile_local.calls[i]);
+            profile_local.cycles[i] = 0;
+            profile_local.calls[i] = 0;
+        }
+    }
+    profile_local.pending = 0;
+}
+
+// Finish timing a stage begun with profile_begin(). Totals stay in the
+// thread until a batch builds up, so the relay path shares no cache lines.
+void profile_end(int stage, unsigned long long start) {
+    if (!profile_enabled) {
+        return;
+    }
+    unsigned long long now = __rdtsc();
+    unsigned long long cycles = now - start;
+
+    profile_local.cycles[stage] += cycles;
+    profile_local.calls[stage]++;
+
+    if (profile_sample > 0 && ++profile_local.tick >= (unsigned int)profile_sample) {
+        int bucket = 0;
+        profile_local.tick = 0;
+        while (bucket < PROFILE_BUCKETS - 1 && (cycles >> bucket) > 1) {
+            bucket++;
+        }
+        InterlockedIncrement64(&stat_stage_hist[stage][bucket]);
+    }
+
+    // Fold in batches, or after a second so a quiet thread's totals still show up
+    if (++profile_local.pending >= PROFILE_FLUSH_EVENTS ||
+        (double)(now - profile_local.last_flush) >= profile_tsc_per_us * 1000000.0) {
+        profile_flush();
+        profile_local.last_flush = now;
+    }
+}
+
+// Measure the TSC rate against the performance counter
+void profile_calibrate() {
+    LARGE_INTEGER freq, q0, q1;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&q0);
+    unsigned long long t0 = __rdtsc();
+    Sleep(100);
+    QueryPerformanceCounter(&q1);
+    unsigned long long t1 = __rdtsc();
+
+    double us = (double)(q1.QuadPart - q0.QuadPart) * 1000000.0 / (double)freq.QuadPart;
+    if (us > 0.0 && t1 > t0) {
+        profile_tsc_per_us = (double)(t1 - t0) / us;
+    }
+}
+
+// Upper bound of the sampled timings' pct-th percentile, in microseconds (0 = no samples)
+double profile_percentile(int stage, double pct) {
+    LONG64 total = 0;
+    LONG64 seen = 0;
+
+    for (int b = 0; b < PROFILE_BUCKETS; b++) {
+        total += stat_stage_hist[stage][b];
+    }
+    if (total == 0) {
+        return 0.0;
+    }
+    for (int b = 0; b < PROFILE_BUCKETS; b++) {
+        seen += stat_stage_hist[stage][b];
+        if ((double)seen >= (double)total * pct / 100.0) {
+            return (double)(2ULL << b) / profile_tsc_per_us;
+        }
+    }
+    return 0.0;
+}
+
+// Append formatted text to a stats line, stopping at the end of the buffer so
+// n never passes len - 1 (snprintf returns the untruncated length)
+void stats_append(char* buf, int len, int* n, const char* fmt, ...) {
+    if (*n >= len - 1) {
+        return;
+    }
+    va_list args;
+    va_start(args, fmt);
+    int written = vsnprintf(buf + *n, len - *n, fmt, args);
+    va_end(args);
+    if (written > 0) {
+        *n += written < len - *n ? written : len - 1 - *n;
+    }
+}
+
+// Format the counters as a single line; returns the length written
+int format_stats(char* buf, int len) {
+    int n = 0;
+    int active = 0;
+
+    for (int i = 0; i < MAX_CONNECTIONS; i++) {
+        if (connections[i].active) {
+            active++;
+        }
+    }
+    stats_append(buf, len, &n, "[STATS] active=%d", active);
+
+    if (tls_enabled) {
+        LONG64 full = stat_tls_full_handshakes;
+        LONG64 resumed = stat_tls_resumed_handshakes;
+        LONG64 total = full + resumed;
+        stats_append(buf, len, &n,
+            " tls_full=%lld tls_resumed=%lld tls_failed=%lld tls_resume_rate=%.1f%% tls_rotations=%lld",
+            full, resumed, (LONG64)stat_tls_failed_handshakes,
+            total > 0 ? 100.0 * (double)resumed / (double)total : 0.0, (LONG64)stat_tls_rotations);
+    }
+
+    if (peer_mode != PEER_NONE) {
+        int links_up = 0;
+        for (int i = 0; i < MUX_MAX_LINKS; i++) {
+            if (mux_links[i].up) {
+                links_up++;
+            }
+        }
+        stats_append(buf, len, &n, " peer_links_up=%d peer_streams=%lld",
+            links_up, (LONG64)stat_mux_streams);
+
+        LONG64 raw = stat_lz4_raw_bytes;
+        if (raw > 0) {
+            stats_append(buf, len, &n, " lz4_ratio=%.2f lz4_bypassed=%lld",
+                (double)stat_lz4_wire_bytes / (double)raw, (LONG64)stat_lz4_bypassed);
+        }
+    }
+
+    if (stat_accept_queue >= 0) {
+        stats_append(buf, len, &n, " accept_queue=%d accept_queue_max=%d syn_queue=%d tcp_attempt_fails=%lld",
+            stat_accept_queue, stat_accept_queue_max, stat_syn_queue, stat_tcp_attempt_fails);
+    }
+
+    if (busy_poll_us > 0) {
+        stats_append(buf, len, &n, " busy_poll_hits=%lld busy_poll_sleeps=%lld busy_poll_spin_ms=%.1f",
+            (LONG64)stat_busy_poll_hits, (LONG64)stat_busy_poll_sleeps,
+            (double)stat_busy_poll_cycles / profile_tsc_per_us / 1000.0);
+    }
+
+    if (balance_policy == BALANCE_HASH && primary_count > 1) {
+        stats_append(buf, len, &n, " hash_spills=%lld", (LONG64)stat_hash_spills);
+    }
+    if (stat_connect_retries > 0) {
+        stats_append(buf, len, &n, " connect_retries=%lld connect_rescued=%lld",
+            (LONG64)stat_connect_retries, (LONG64)stat_connect_rescued);
+    }
+    for (int i = 0; i < backend_count; i++) {
+        backend_t* b = &backends[i];
+        if (breaker_threshold > 0) {
+            stats_append(buf, len, &n, " breaker_%d=%s breaker_%d_opens=%lld breaker_%d_fast_fails=%lld",
+                i, breaker_state_names[b->state], i, (LONG64)b->opens, i, (LONG64)b->fast_fails);
+        }
+        if (backend_count > 1) {
+            stats_append(buf, len, &n, " backend_%d_picks=%lld backend_%d_active=%ld"
+                " backend_%d_connect_ms=%.1f backend_%d_ttfb_ms=%.1f",
+                i, (LONG64)b->picks, i, (long)b->active,
+                i, b->ewma_connect_us / 1000.0, i, b->ewma_ttfb_us / 1000.0);
+        }
+    }
+
+    LONG64 shed = stat_shed;
+    if (shed > 0) {
+        stats_append(buf, len, &n, " shed=%lld", shed);
+    }
+
+    LONG64 accepts = stat_accepts;
+    if (accepts > 0) {
+        stats_append(buf, len, &n, " accepts=%lld setup_syscalls_per_conn=%.1f",
+            accepts, (double)stat_setup_syscalls / (double)accepts);
+    }
+
+    if (mirror_host != NULL) {
+        stats_append(buf, len, &n, " mirror_bytes=%lld mirror_drops=%lld mirror_connect_failures=%lld",
+            (LONG64)stat_mirror_bytes, (LONG64)stat_mirror_drops, (LONG64)stat_mirror_connect_failures);
+    }
+
+    // Close reasons seen so far, e.g. close_client_recv_reset=3
+    for (int i = 0; i < 256; i++) {
+        LONG64 count = stat_closes[i];
+        if (count > 0) {
+            char reason[48];
+            format_close_reason(reason, sizeof(reason), i);
+            stats_append(buf, len, &n, " close_%s=%lld", reason, count);
+        }
+    }
+
+    if (capture_path != NULL) {
+        stats_append(buf, len, &n, " capture_packets=%lld capture_drops=%lld",
+            (LONG64)stat_capture_packets, (LONG64)capture_writer.ring.drops);
+    }
+
+    if (record_path != NULL) {
+        stats_append(buf, len, &n, " record_events=%lld record_drops=%lld",
+            (LONG64)stat_record_events, (LONG64)record_writer.ring.drops);
+    }
+
+    // Time spent in each stage, e.g. stage_relay_calls=120 stage_relay_ms=3.2
+    for (int i = 0; profile_enabled && i < STAGE_COUNT; i++) {
+        LONG64 calls = stat_stage_calls[i];
+        if (calls > 0) {
+            stats_append(buf, len, &n, " stage_%s_calls=%lld stage_%s_ms=%.1f",
+                stage_names[i], calls, stage_names[i],
+                (double)stat_stage_cycles[i] / profile_tsc_per_us / 1000.0);
+            if (profile_sample > 0) {
+                stats_append(buf, len, &n, " stage_%s_p50_us=%.0f stage_%s_p99_us=%.0f",
+                    stage_names[i], profile_percentile(i, 50.0), stage_names[i], profile_percentile(i, 99.0));
+            }
+        }
+    }
+
+    return n;
+}
+
+// Print the counters to stdout (to the console in --top mode, where stdout is silenced)
+void print_stats() {
+    char line[STATS_LINE_SIZE];
+    format_stats(line, sizeof(line));
+    fprintf(top_out != NULL ? top_out : stdout, "%s\n", line);
+}
+
+// Row of the --top view
+typedef struct {
+    connection_t* conn;
+    unsigned long long id;
+    double in_rate;    // Client -> remote bytes/sec
+    double out_rate;   // Remote -> client bytes/sec
+} top_row_t;
+
+// Per-slot byte counts at the previous redraw, to turn totals into rates
+typedef struct {
+    unsigned long long id;
+    unsigned long long in;
+    unsigned long long out;
+} top_sample_t;
+
+top_sample_t top_prev[MAX_CONNECTIONS];
+ULONGLONG top_prev_tick = 0;
+
+// Format a byte rate as e.g. "12.3M"
+void format_rate(char* buf, int len, double rate) {
+    const char* units = " KMGT";
+    int u = 0;
+    while (rate >= 1000.0 && u < 4) {
+        rate /= 1024.0;
+        u++;
+    }
+    snprintf(buf, len, u == 0 ? "%.0f%c" : "%.1f%c", rate, units[u]);
+}
+
+// Format a duration in milliseconds as h:mm:ss
+void format_duration(char* buf, int len, ULONGLONG ms) {
+    ULONGLONG s = ms / 1000;
+    snprintf(buf, len, "%llu:%02llu:%02llu", s / 3600, (s / 60) % 60, s % 60);
+}
+
+// Sort rows by total rate, busiest first
+int top_row_compare(const void* a, const void* b) {
+    double ra = ((const top_row_t*)a)->in_rate + ((const top_row_t*)a)->out_rate;
+    double rb = ((const top_row_t*)b)->in_rate + ((const top_row_t*)b)->out_rate;
+    return ra < rb ? 1 : ra > rb ? -1 : 0;
+}
+
+// Redraw the --top view. Reads the relay threads' counters without locking:
+// a slightly stale value only skews one refresh.
+void top_draw(ULONGLONG now) {
+    top_row_t rows[MAX_CONNECTIONS];
+    int count = 0;
+    double total_in = 0.0;
+    double total_out = 0.0;
+    double dt = top_prev_tick != 0 ? (double)(now - top_prev_tick) / 1000.0 : 1.0;
+    char stats[STATS_LINE_SIZE];
+
+    if (dt <= 0.0) {
+        dt = 1.0;
+    }
+
+    for (int i = 0; i < MAX_CONNECTIONS; i++) {
+        connection_t* conn = &connections[i];
+        unsigned long long id = conn->id;
+        unsigned long long in = conn->bytes_client_to_remote;
+        unsigned long long out = conn->bytes_remote_to_client;
+
+        if (conn->active && id != 0) {
+            top_row_t* row = &rows[count++];
+            row->conn = conn;
+            row->id = id;
+            if (top_prev[i].id == id) {
+                row->in_rate = (double)(in - top_prev[i].in) / dt;
+                row->out_rate = (double)(out - top_prev[i].out) / dt;
+            }
+            else {
+                // New since the last redraw: average over its lifetime so far
+                double age = (double)(now - conn->started) / 1000.0;
+                row->in_rate = (double)in / (age > dt ? dt : age > 0.001 ? age : 0.001);
+                row->out_rate = (double)out / (age > dt ? dt : age > 0.001 ? age : 0.001);
+            }
+            total_in += row->in_rate;
+            total_out += row->out_rate;
+        }
+        top_prev[i].id = id;
+        top_prev[i].in = in;
+        top_prev[i].out = out;
+    }
+    top_prev_tick = now;
+
+    qsort(rows, count, sizeof(top_row_t), top_row_compare);
+
+    char in_str[16], out_str[16];
+    format_rate(in_str, sizeof(in_str), total_in);
+    format_rate(out_str, sizeof(out_str), total_out);
+    format_stats(stats, sizeof(stats));
+
+    // Home the cursor and clear, then draw the whole frame at once
+    fprintf(top_out, "\x1b[H\x1b[2JPortForwarder - %d active, in %sB/s, out %sB/s (Ctrl+C to quit)\n%s\n\n",
+        count, in_str, out_str, stats);
+    fprintf(top_out, "%8s  %-21s  %-24s  %9s  %8s  %8s  %9s\n",
+        "ID", "SOURCE", "BACKEND", "AGE", "IN/s", "OUT/s", "IDLE");
+
+    for (int i = 0; i < count; i++) {
+        connection_t* conn = rows[i].conn;
+        char source[ADDR_TEXT_LEN], age[16], idle[16];
+        ULONGLONG last = conn->last_activity;
+
+        if (conn->client_addr.ss_family != 0) {
+            format_addr(source, sizeof(source), &conn->client_addr);
+        }
+        else {
+            snprintf(source, sizeof(source), "peer stream %u", conn->stream_id);
+        }
+        format_duration(age, sizeof(age), now - conn->started);
+        format_duration(idle, sizeof(idle), now > last ? now - last : 0);
+        format_rate(in_str, sizeof(in_str), rows[i].in_rate);
+        format_rate(out_str, sizeof(out_str), rows[i].out_rate);
+
+        fprintf(top_out, "%8llu  %-21s  %-24.24s  %9s  %8s  %8s  %9s\n",
+            rows[i].id, source, conn->backend != NULL ? conn->backend->label : "-", age, in_str, out_str, idle);
+    }
+    fflush(top_out);
+}
+
+// Is addr the client of a connection or peer link we already accepted?
+int accept_is_ours(const struct sockaddr_storage* addr) {
+    if (accept_busy && addr_equal(&accept_current, addr)) {
+        return 1;
+    }
+    for (int i = 0; i < MAX_CONNECTIONS; i++) {
+        if (connections[i].active && addr_equal(&connections[i].client_addr, addr)) {
+            return 1;
+        }
+    }
+    for (int i = 0; i < MUX_MAX_LINKS && peer_mode == PEER_EXIT; i++) {
+        if (mux_links[i].in_use && addr_equal(&mux_links[i].peer_addr, addr)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Count our listener's half-open and unaccepted connections in one family's
+// TCP table. *table is kept between calls and grown as the table grows.
+void accept_queue_scan(ULONG family, void** table, ULONG* table_size, int* syn, int* queued) {
+    DWORD pid = GetCurrentProcessId();
+    DWORD result;
+
+    result = GetExtendedTcpTable(*table, table_size, FALSE, family, TCP_TABLE_OWNER_PID_CONNECTIONS, 0);
+    if (result == ERROR_INSUFFICIENT_BUFFER) {
+        // The table grows with the system's connection count; leave room for more
+        free(*table);
+        *table_size += *table_size / 4;
+        *table = malloc(*table_size);
+        if (*table == NULL) {
+            *table_size = 0;
+            return;
+        }
+        result = GetExtendedTcpTable(*table, table_size, FALSE, family, TCP_TABLE_OWNER_PID_CONNECTIONS, 0);
+    }
+    if (result != NO_ERROR) {
+        return;
+    }
+
+    DWORD count = family == AF_INET ? ((MIB_TCPTABLE_OWNER_PID*)*table)->dwNumEntries :
+        ((MIB_TCP6TABLE_OWNER_PID*)*table)->dwNumEntries;
+    for (DWORD i = 0; i < count; i++) {
+        struct sockaddr_storage addr;
+        DWORD owner, local_port, state;
+
+        ZeroMemory(&addr, sizeof(addr));
+        if (family == AF_INET) {
+            MIB_TCPROW_OWNER_PID* row = &((MIB_TCPTABLE_OWNER_PID*)*table)->table[i];
+            struct sockaddr_in* v4 = (struct sockaddr_in*)&addr;
+            v4->sin_family = AF_INET;
+            v4->sin_addr.s_addr = row->dwRemoteAddr;
+            v4->sin_port = (u_short)row->dwRemotePort;
+            owner = row->dwOwningPid;
+            local_port = row->dwLocalPort;
+            state = row->dwState;
+        }
+        else {
+            MIB_TCP6ROW_OWNER_PID* row = &((MIB_TCP6TABLE_OWNER_PID*)*table)->table[i];
+            struct sockaddr_in6* v6 = (struct sockaddr_in6*)&addr;
+            v6->sin6_family = AF_INET6;
+            memcpy(v6->sin6_addr.s6_addr, row->ucRemoteAddr, 16);
+            v6->sin6_port = (u_short)row->dwRemotePort;
+            addr_unmap(&addr);
+            owner = row->dwOwningPid;
+            local_port = row->dwLocalPort;
+            state = row->dwState;
+        }
+        if (owner != pid || ntohs((u_short)local_port) != listen_port) {
+            continue;
+        }
+        if (state == MIB_TCP_STATE_SYN_RCVD) {
+            (*syn)++;
+        }
+        else if (state == MIB_TCP_STATE_ESTAB && !accept_is_ours(&addr)) {
+            (*queued)++;
+        }
+    }
+}
+
+// Sample the listener's queues from the TCP table. Windows has no per-listener
+// queue counter, so count our process's connections on the listen port: those
+// still handshaking are the SYN queue, and established ones we haven't
+// accepted are the accept queue.
+void accept_queue_sample(ULONGLONG now) {
+    static ULONG table_sizes[2] = { 0, 0 };
+    static void* tables[2] = { NULL, NULL };
+    static DWORD fails_base = 0;
+    static int fails_based = 0;
+    static int behind = 0;
+    static ULONGLONG last_warning = 0;
+    int queued = 0;
+    int syn = 0;
+
+    // A dual-stack listener's clients can show up in either table
+    accept_queue_scan(AF_INET, &tables[0], &table_sizes[0], &syn, &queued);
+    if (listen_family == AF_INET6) {
+        accept_queue_scan(AF_INET6, &tables[1], &table_sizes[1], &syn, &queued);
+    }
+
+    // Windows doesn't count listen overflows; failed attempts are the closest system-wide signal
+    MIB_TCPSTATS tcp_stats;
+    DWORD fails = 0;
+    int have_fails = GetTcpStatisticsEx(&tcp_stats, AF_INET) == NO_ERROR;
+    fails += have_fails ? tcp_stats.dwAttemptFails : 0;
+    if (have_fails && listen_family == AF_INET6 && GetTcpStatisticsEx(&tcp_stats, AF_INET6) == NO_ERROR) {
+        fails += tcp_stats.dwAttemptFails;
+    }
+    if (have_fails) {
+        if (!fails_based) {
+            fails_base = fails;
+            fails_based = 1;
+        }
+        stat_tcp_attempt_fails = (LONG64)(DWORD)(fails - fails_base);
+    }
+
+    stat_accept_queue = queued;
+    stat_syn_queue = syn;
+    if (queued > stat_accept_queue_max) {
+        stat_accept_queue_max = queued;
+    }
+
+    // Warn when the queue is half full, or has not emptied for several seconds
+    int backlog = listen_backlog > 0 ? listen_backlog : DEFAULT_BACKLOG;
+    behind = queued > 0 ? behind + 1 : 0;
+    if ((queued * 2 >= backlog || behind >= BACKLOG_WARN_SECONDS) &&
+        now - last_warning >= BACKLOG_WARN_INTERVAL_MS) {
+        fprintf(stderr, "[WARN] Accept loop is falling behind: %d connections waiting, %d handshaking (backlog %d)\n",
+            queued, syn, backlog);
+        last_warning = now;
+    }
+}
+
+// Periodic housekeeping: stats output, --top redraws, accept queue sampling and TLS credential rotation
+DWORD WINAPI maintenance_thread(LPVOID param) {
+    ULONGLONG last_stats = GetTickCount64();
+    (void)param;
+
+    while (running) {
+        Sleep(1000);
+        ULONGLONG now = GetTickCount64();
+
+        accept_queue_sample(now);
+
+        if (top_mode) {
+            top_draw(now);
+        }
+        else if (stats_interval > 0 && now - last_stats >= (ULONGLONG)stats_interval * 1000) {
+            print_stats();
+            last_stats = now;
+        }
+
+        if (tls_enabled && tls_rotate_interval > 0 &&
+            now - tls_last_rotation >= (ULONGLONG)tls_rotate_interval * 1000) {
+            tls_rotate_cred();
+            tls_last_rotation = now;
+        }
+    }
+    return 0;
+}
+
+// Apply the relay socket options selected by opts (SOCKOPT_*), using the keepalive
+// profile of the socket's leg; callers leave out what the socket already has,
+// e.g. options inherited from the listener
+void configure_socket(SOCKET s, int leg, int opts) {
+    keepalive_profile_t* ka = &keepalive_profiles[leg];
+    int calls = 0;
+
+    // Set socket to blocking mode for reliable data transfer
+    if (opts & SOCKOPT_BLOCKING) {
+        u_long mode = 0;
+        ioctlsocket(s, FIONBIO, &mode);
+        calls++;
+    }
+
+    // Set socket timeouts to detect dead connections
+    if (opts & SOCKOPT_TIMEOUTS) {
+        int timeout_ms = 30000; // 30 seconds
+        setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout_ms, sizeof(timeout_ms));
+        setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, (char*)&timeout_ms, sizeof(timeout_ms));
+        calls += 2;
+    }
+
+    // Disable Nagle's algorithm for lower latency
+    if (opts & SOCKOPT_NODELAY) {
+        int flag = 1;
+        setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (char*)&flag, sizeof(int));
+        calls++;
+    }
+
+    // Enable keepalive unless this leg's profile turns it off (new sockets start with it off)
+    if ((opts & SOCKOPT_KEEPALIVE) && ka->enabled) {
+        int keepalive = 1;
+        setsockopt(s, SOL_SOCKET, SO_KEEPALIVE, (char*)&keepalive, sizeof(int));
+        calls++;
+    }
+
+    // Set TCP keepalive parameters (Windows-specific): one call for idle and interval
+    if ((opts & SOCKOPT_KEEPALIVE_VALS) && ka->enabled) {
+        struct tcp_keepalive ka_settings;
+        ka_settings.onoff = 1;
+        ka_settings.keepalivetime = (ULONG)ka->idle * 1000;
+        ka_settings.keepaliveinterval = (ULONG)ka->interval * 1000;
+        DWORD bytes_returned;
+        WSAIoctl(s, SIO_KEEPALIVE_VALS, &ka_settings, sizeof(ka_settings),
+            NULL, 0, &bytes_returned, NULL, NULL);
+        calls++;
+
+        // Probe count (Windows 10 1703 and later; older systems keep 10)
+        if (ka->count > 0) {
+            setsockopt(s, IPPROTO_TCP, TCP_KEEPCNT, (char*)&ka->count, sizeof(int));
+            calls++;
+        }
+    }
+
+    // Give up on unacknowledged data after user_timeout, like Linux's TCP_USER_TIMEOUT
+    if ((opts & SOCKOPT_KEEPALIVE_VALS) && ka->user_timeout > 0) {
+        setsockopt(s, IPPROTO_TCP, TCP_MAXRT, (char*)&ka->user_timeout, sizeof(int));
+        calls++;
+    }
+
+    InterlockedAdd64(&stat_setup_syscalls, calls);
+}
+
+// Find out which relay options accepted sockets inherit from their listener:
+// set them on a loopback listener, accept one connection and read them back.
+// Winsock documents inheritance only loosely, so nothing is assumed. The probe
+// uses the same address family as the real listener.
+int probe_inherited_options(int family) {
+    SOCKET listener = socket(family, SOCK_STREAM, IPPROTO_TCP);
+    SOCKET client = socket(family, SOCK_STREAM, IPPROTO_TCP);
+    SOCKET accepted = INVALID_SOCKET;
+    struct sockaddr_storage addr;
+    int addr_len = sizeof(addr);
+    int inherited = 0;
+
+    ZeroMemory(&addr, sizeof(addr));
+    if (family == AF_INET6) {
+        ((struct sockaddr_in6*)&addr)->sin6_family = AF_INET6;
+        ((struct sockaddr_in6*)&addr)->sin6_addr = in6addr_loopback;
+    }
+    else {
+        ((struct sockaddr_in*)&addr)->sin_family = AF_INET;
+        ((struct sockaddr_in*)&addr)->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    }
+
+    if (listener != INVALID_SOCKET && client != INVALID_SOCKET &&
+        bind(listener, (struct sockaddr*)&addr, addr_size(&addr)) == 0 &&
+        getsockname(listener, (struct sockaddr*)&addr, &addr_len) == 0 &&
+        listen(listener, 1) == 0) {
+        configure_socket(listener, LEG_CLIENT, SOCKOPT_ALL & ~SOCKOPT_BLOCKING);
+        if (connect(client, (struct sockaddr*)&addr, addr_size(&addr)) == 0) {
+            accepted = accept(listener, NULL, NULL);
+        }
+    }
+
+    if (accepted != INVALID_SOCKET) {
+        int value = 0;
+        int value_len = sizeof(value);
+        int timeout_ms = 0;
+        int timeout_len = sizeof(timeout_ms);
+
+        if (getsockopt(accepted, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout_ms, &timeout_len) == 0 &&
+            timeout_ms == 30000) {
+            timeout_len = sizeof(timeout_ms);
+            timeout_ms = 0;
+            if (getsockopt(accepted, SOL_SOCKET, SO_SNDTIMEO, (char*)&timeout_ms, &timeout_len) == 0 &&
+                timeout_ms == 30000) {
+                inherited |= SOCKOPT_TIMEOUTS;
+            }
+        }
+        if (getsockopt(accepted, IPPROTO_TCP, TCP_NODELAY, (char*)&value, &value_len) == 0 && value != 0) {
+            inherited |= SOCKOPT_NODELAY;
+        }
+        value = 0;
+        value_len = sizeof(value);
+        if (getsockopt(accepted, SOL_SOCKET, SO_KEEPALIVE, (char*)&value, &value_len) == 0 && value != 0) {
+            inherited |= SOCKOPT_KEEPALIVE;
+        }
+        // SIO_KEEPALIVE_VALS can't be read back, so it is always applied per socket
+        closesocket(accepted);
+    }
+
+    if (client != INVALID_SOCKET) {
+        closesocket(client);
+    }
+    if (listener != INVALID_SOCKET) {
+        closesocket(listener);
+    }
+    return inherited;
+}
+
+// Parse a keepalive profile: "off" or "<idle>,<interval>[,<count>[,<user_timeout>]]" in seconds
+int parse_keepalive(const char* spec, keepalive_profile_t* ka) {
+    keepalive_profile_t parsed = { 1, 0, 0, 0, 0 };
+
+    if (strcmp(spec, "off") == 0) {
+        ka->enabled = 0;
+        return 0;
+    }
+    // end is set after each field that parsed, so trailing junk is caught
+    int end = -1;
+    if (sscanf(spec, "%d,%d%n,%d%n,%d%n", &parsed.idle, &parsed.interval, &end,
+        &parsed.count, &end, &parsed.user_timeout, &end) < 2 || end < 0 || spec[end] != '\0' ||
+        parsed.idle < 1 || parsed.idle > KEEPALIVE_MAX_SECONDS ||
+        parsed.interval < 1 || parsed.interval > KEEPALIVE_MAX_SECONDS ||
+        parsed.count < 0 || parsed.count > 255 ||
+        parsed.user_timeout < 0 || parsed.user_timeout > KEEPALIVE_MAX_SECONDS) {
+        return -1;
+    }
+    *ka = parsed;
+    return 0;
+}
+
+// Parse a rate limit in KB/s ("0" = unlimited) into bytes/sec. Rejects
+// trailing junk, negatives and rates too large for a LONG.
+int parse_rate_limit(const char* text, LONG* limit) {
+    char* end;
+    errno = 0;
+    long long kb = strtoll(text, &end, 10);
+    if (end == text || *end != '\0' || errno == ERANGE || kb < 0 || kb > MAXLONG / 1024) {
+        return -1;
+    }
+    *limit = (LONG)(kb * 1024);
+    return 0;
+}
+
+// Parse a whole number in [min, max]; rejects empty input and trailing junk
+int parse_int(const char* text, int min, int max, int* value) {
+    char* end;
+    errno = 0;
+    long long parsed = strtoll(text, &end, 10);
+    if (end == text || *end != '\0' || errno == ERANGE || parsed < min || parsed > max) {
+        return -1;
+    }
+    *value = (int)parsed;
+    return 0;
+}
+
+// Read the whole-number value of the option at argv[*i] and step past it.
+// Prints a usage error and returns -1 if it is malformed or out of range.
+int option_int(char* argv[], int* i, int min, int max, int* value) {
+    const char* name = argv[*i];
+    const char* text = argv[++*i];
+    if (parse_int(text, min, max, value) != 0) {
+        fprintf(stderr, "[ERROR] %s expects a whole number from %d to %d, not \"%s\"\n", name, min, max, text);
+        return -1;
+    }
+    return 0;
+}
+
+// Same for an option taking a decimal number of at least min
+int option_double(char* argv[], int* i, double min, double* value) {
+    const char* name = argv[*i];
+    const char* text = argv[++*i];
+    char* end;
+    double parsed = strtod(text, &end);
+    if (end == text || *end != '\0' || !(parsed >= min) || parsed > 1e9) {
+        fprintf(stderr, "[ERROR] %s expects a number of at least %g, not \"%s\"\n", name, min, text);
+        return -1;
+    }
+    *value = parsed;
+    return 0;
+}
+
+// Describe a keepalive profile, e.g. "10s/1s x5, maxrt 30s"
+void format_keepalive(char* buf, int len, const keepalive_profile_t* ka) {
+    int n = ka->enabled ? snprintf(buf, len, "%ds/%ds", ka->idle, ka->interval) : snprintf(buf, len, "off");
+    if (ka->enabled && ka->count > 0) {
+        n += snprintf(buf + n, len - n, " x%d", ka->count);
+    }
+    if (ka->user_timeout > 0) {
+        snprintf(buf + n, len - n, ", maxrt %ds", ka->user_timeout);
+    }
+}
+
+// Connect s to addr, giving up after timeout_ms (0 = the system's own limit).
+// Returns 0 or the Winsock error; s is left in blocking mode either way.
+int connect_within(SOCKET s, const struct sockaddr* addr, int addr_len, int timeout_ms) {
+    if (timeout_ms == 0) {
+        return connect(s, addr, addr_len) == SOCKET_ERROR ? WSAGetLastError() : 0;
+    }
+
+    u_long mode = 1;
+    ioctlsocket(s, FIONBIO, &mode);
+    int error = 0;
+    if (connect(s, addr, addr_len) == SOCKET_ERROR) {
+        error = WSAGetLastError();
+        if (error == WSAEWOULDBLOCK) {
+            fd_set writefds, exceptfds;
+            struct timeval timeout;
+            FD_ZERO(&writefds);
+            FD_ZERO(&exceptfds);
+            FD_SET(s, &writefds);
+            FD_SET(s, &exceptfds);
+            timeout.tv_sec = timeout_ms / 1000;
+            timeout.tv_usec = (timeout_ms % 1000) * 1000;
+            int ready = select(0, NULL, &writefds, &exceptfds, &timeout);
+            if (ready == 0) {
+                error = WSAETIMEDOUT;
+            }
+            else if (ready == SOCKET_ERROR) {
+                error = WSAGetLastError();
+            }
+            else if (FD_ISSET(s, &exceptfds)) {
+                // Windows reports a failed non-blocking connect here, not as writable
+                int len = sizeof(error);
+                getsockopt(s, SOL_SOCKET, SO_ERROR, (char*)&error, &len);
+                if (error == 0) {
+                    error = WSAECONNREFUSED;
+                }
+            }
+            else {
+                error = 0;
+            }
+        }
+    }
+    mode = 0;
+    ioctlsocket(s, FIONBIO, &mode);
+    return error;
+}
+
+// Resolve and connect to host:port, trying each address the name resolves to.
+// Each attempt is limited to timeout_ms (0 = the system's own limit) and all
+// of them to deadline (a GetTickCount64() value, 0 = none). Relay connects
+// (relay = 1) are timed as the DNS and connect stages and report failures;
+// side connects such as the mirror's do neither. Returns INVALID_SOCKET on
+// failure, with the Winsock error set.
+SOCKET connect_host(const char* host, int port, ULONGLONG deadline, int timeout_ms, int relay) {
+    SOCKET s = INVALID_SOCKET;
+    struct addrinfo hints, * result = NULL;
+    char port_str[16];
+    int error = 0;
+
+    // Convert port to string
+    snprintf(port_str, sizeof(port_str), "%d", port);
+
+    // Resolve remote address
+    ZeroMemory(&hints, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+
+    unsigned long long stage_start = relay ? profile_begin() : 0;
+    if (getaddrinfo(host, port_str, &hints, &result) != 0) {
+        if (relay) {
+            print_error("getaddrinfo() failed");
+        }
+        return INVALID_SOCKET;
+    }
+    if (relay) {
+        profile_end(STAGE_DNS, stage_start);
+        stage_start = profile_begin();
+    }
+
+    // Try each resolved address in turn until one accepts or the deadline passes
+    for (struct addrinfo* ai = result; ai != NULL; ai = ai->ai_next) {
+        int attempt_ms = timeout_ms;
+        if (deadline != 0) {
+            ULONGLONG now = GetTickCount64();
+            if (now >= deadline) {
+                error = WSAETIMEDOUT;
+                break;
+            }
+            if (attempt_ms == 0 || deadline - now < (ULONGLONG)attempt_ms) {
+                attempt_ms = (int)(deadline - now);
+            }
+        }
+
+        s = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (s == INVALID_SOCKET) {
+            error = WSAGetLastError();
+            continue;
+        }
+        error = connect_within(s, ai->ai_addr, (int)ai->ai_addrlen, attempt_ms);
+        if (error == 0) {
+            break;
+        }
+        closesocket(s);
+        s = INVALID_SOCKET;
+    }
+    freeaddrinfo(result);
+
+    if (s == INVALID_SOCKET) {
+        if (relay) {
+            WSASetLastError(error);
+            print_error("connect() to remote failed");
+        }
+        WSASetLastError(error);  // Callers classify the failure
+        return INVALID_SOCKET;
+    }
+    if (relay) {
+        profile_end(STAGE_CONNECT, stage_start);
+    }
+    return s;
+}
+
+// Connect a relay leg to host:port within connect_timeout_ms per attempt
+SOCKET connect_remote(const char* host, int port, ULONGLONG deadline) {
+    return connect_host(host, port, deadline, connect_timeout_ms, 1);
+}
+
+// Split "host:port" in place; returns the port or 0 if malformed
+int split_host_port(char* spec, char** host) {
+    char* colon = strrchr(spec, ':');
+    if (colon == NULL || colon == spec) {
+        return 0;
+    }
+    *colon = '\0';
+    *host = spec;
+    int port;
+    return parse_int(colon + 1, 1, 65535, &port) == 0 ? port : 0;
+}
+
+// Queue a copy of client->remote bytes for the mirror. Never blocks on the
+// mirror: if the queue is full the chunk is dropped and this connection stops
+// mirroring (a gap would leave the shadow backend with a corrupt stream).
+void mirror_enqueue(connection_t* conn, int type, const char* data, int len) {
+    if (mirror_host == NULL || conn->mirror_broken) {
+        return;
+    }
+
+    EnterCriticalSection(&mirror_lock);
+    if (mirror_count == MIRROR_QUEUE_SLOTS) {
+        LeaveCriticalSection(&mirror_lock);
+        if (type == MIRROR_DATA) {
+            conn->mirror_broken = 1;
+        }
+        InterlockedIncrement64(&stat_mirror_drops);
+        return;
+    }
+    mirror_entry_t* entry = &mirror_queue[(mirror_head + mirror_count) % MIRROR_QUEUE_SLOTS];
+    entry->slot = (int)(conn - connections);
+    entry->id = conn->id;
+    entry->type = type;
+    entry->len = len;
+    if (len > 0) {
+        memcpy(entry->data, data, len);
+    }
+    mirror_count++;
+    LeaveCriticalSection(&mirror_lock);
+
+    SetEvent(mirror_event);
+}
+
+// Close the mirror side of a connection
+void mirror_drop_target(int slot) {
+    if (mirror_targets[slot].socket != INVALID_SOCKET) {
+        shutdown(mirror_targets[slot].socket, SD_BOTH);
+        closesocket(mirror_targets[slot].socket);
+        mirror_targets[slot].socket = INVALID_SOCKET;
+    }
+    mirror_targets[slot].id = 0;
+}
+
+// Deliver queued chunks to the shadow backend; the only thread that touches mirror sockets
+DWORD WINAPI mirror_thread(LPVOID param) {
+    mirror_entry_t* entry = (mirror_entry_t*)malloc(sizeof(mirror_entry_t));
+    char discard[BUFFER_SIZE];
+    ULONGLONG retry_after = 0;
+    (void)param;
+
+    if (entry == NULL) {
+        fprintf(stderr, "[ERROR] Out of memory for mirror thread\n");
+        return 1;
+    }
+
+    while (running) {
+        WaitForSingleObject(mirror_event, 100);
+
+        for (;;) {
+            EnterCriticalSection(&mirror_lock);
+            if (mirror_count == 0) {
+                LeaveCriticalSection(&mirror_lock);
+                break;
+            }
+            mirror_entry_t* head = &mirror_queue[mirror_head];
+            memcpy(entry, head, offsetof(mirror_entry_t, data) + head->len);
+            mirror_head = (mirror_head + 1) % MIRROR_QUEUE_SLOTS;
+            mirror_count--;
+            LeaveCriticalSection(&mirror_lock);
+
+            mirror_target_t* target = &mirror_targets[entry->slot];
+
+            if (entry->type == MIRROR_CLOSE) {
+                if (target->id == entry->id) {
+                    mirror_drop_target(entry->slot);
+                }
+                continue;
+            }
+
+            // First chunk of a connection (or slot reused): open a new mirror connection
+            if (target->id != entry->id) {
+                mirror_drop_target(entry->slot);
+                target->id = entry->id;
+                if (GetTickCount64() < retry_after) {
+                    InterlockedIncrement64(&stat_mirror_drops);
+                    continue;  // Mirror recently unreachable; skip this connection
+                }
+                target->socket = connect_host(mirror_host, mirror_port, 0, MIRROR_CONNECT_MS, 0);
+                if (target->socket == INVALID_SOCKET) {
+                    InterlockedIncrement64(&stat_mirror_connect_failures);
+                    InterlockedIncrement64(&stat_mirror_drops);
+                    retry_after = GetTickCount64() + MIRROR_RETRY_MS;
+                    continue;
+                }
+                // A stuck mirror must not hold this thread for long
+                int timeout_ms = 1000;
+                setsockopt(target->socket, SOL_SOCKET, SO_SNDTIMEO, (char*)&timeout_ms, sizeof(timeout_ms));
+            }
+
+            if (target->socket == INVALID_SOCKET) {
+                InterlockedIncrement64(&stat_mirror_drops);
+                continue;
+            }
+
+            if (send_all(target->socket, entry->data, entry->len) == SOCKET_ERROR) {
+                InterlockedIncrement64(&stat_mirror_drops);
+                mirror_drop_target(entry->slot);
+                target->id = entry->id;  // Don't reconnect mid-stream
+                continue;
+            }
+            InterlockedAdd64(&stat_mirror_bytes, entry->len);
+        }
+
+        // Discard mirror responses so its send buffer never fills, and close
+        // mirrors whose connection is gone or lost a chunk to overflow
+        for (int i = 0; i < MAX_CONNECTIONS; i++) {
+            mirror_target_t* target = &mirror_targets[i];
+            if (target->socket == INVALID_SOCKET) {
+                continue;
+            }
+            if (!connections[i].active || connections[i].id != target->id || connections[i].mirror_broken) {
+                mirror_drop_target(i);
+                continue;
+            }
+            u_long available = 0;
+            while (ioctlsocket(target->socket, FIONREAD, &available) == 0 && available > 0) {
+                if (recv(target->socket, discard, sizeof(discard), 0) <= 0) {
+                    break;
+                }
+            }
+        }
+    }
+
+    for (int i = 0; i < MAX_CONNECTIONS; i++) {
+        mirror_drop_target(i);
+    }
+    free(entry);
+    return 0;
+}
+
+// Slot for ring position pos
+ring_slot_t* ring_slot(record_ring_t* ring, LONG64 pos) {
+    return (ring_slot_t*)(ring->slots + (size_t)(pos & ring->mask) * ring->slot_size);
+}
+
+// Allocate a ring of `count` slots (a power of two), each holding up to data_cap bytes
+int ring_init(record_ring_t* ring, int count, int data_cap) {
+    // Round up so every slot's 64-bit fields stay aligned
+    ring->slot_size = (int)((offsetof(ring_slot_t, data) + data_cap + 7) & ~(size_t)7);
+    ring->data_cap = data_cap;
+    ring->slots = (char*)malloc((size_t)ring->slot_size * count);
+    if (ring->slots == NULL) {
+        return -1;
+    }
+    ring->mask = count - 1;
+    for (int i = 0; i < count; i++) {
+        ring_slot(ring, i)->seq = i;
+    }
+    ring->head = 0;
+    ring->tail = 0;
+    ring->drops = 0;
+    return 0;
+}
+
+// Current wall-clock time in microseconds since the Unix epoch
+LONG64 now_us() {
+    FILETIME ft;
+    ULARGE_INTEGER t;
+    GetSystemTimePreciseAsFileTime(&ft);
+    t.LowPart = ft.dwLowDateTime;
+    t.HighPart = ft.dwHighDateTime;
+    return (LONG64)((t.QuadPart - 116444736000000000ULL) / 10);
+}
+
+// Append a record without blocking; returns -1 (and counts a drop) if the ring is full
+int ring_push(record_ring_t* ring, connection_t* conn, int type, LONG64 offset, const char* data, int len) {
+    LONG64 pos = ring->head;
+    ring_slot_t* rec;
+
+    if (len > ring->data_cap) {
+        InterlockedIncrement64(&ring->drops);
+        return -1;
+    }
+    for (;;) {
+        rec = ring_slot(ring, pos);
+        LONG64 diff = ReadAcquire64(&rec->seq) - pos;
+        if (diff == 0) {
+            // Slot is free for this position; claim it
+            LONG64 seen = InterlockedCompareExchange64(&ring->head, pos + 1, pos);
+            if (seen == pos) {
+                break;
+            }
+            pos = seen;
+        }
+        else if (diff < 0) {
+            // The writer hasn't consumed this slot from the previous lap
+            InterlockedIncrement64(&ring->drops);
+            return -1;
+        }
+        else {
+            pos = ring->head;
+        }
+    }
+
+    rec->id = conn->id;
+    rec->slot = (int)(conn - connections);
+    rec->time_us = now_us();
+    rec->offset = offset;
+    rec->type = type;
+    rec->len = len;
+    if (len > 0 && data != NULL) {
+        memcpy(rec->data, data, len);
+    }
+    WriteRelease64(&rec->seq, pos + 1);  // Publish to the consumer
+    return 0;
+}
+
+// Oldest published record, or NULL if none; single consumer only
+ring_slot_t* ring_peek(record_ring_t* ring) {
+    ring_slot_t* rec = ring_slot(ring, ring->tail);
+    return ReadAcquire64(&rec->seq) == ring->tail + 1 ? rec : NULL;
+}
+
+// Hand the record returned by ring_peek() back to the producers
+void ring_pop(record_ring_t* ring) {
+    ring_slot_t* rec = ring_slot(ring, ring->tail);
+    WriteRelease64(&rec->seq, ring->tail + ring->mask + 1);
+    ring->tail++;
+}
+
+// Create the writer's file and ring; the caller writes any file header before starting the thread
+int ring_writer_open(ring_writer_t* writer, const char* path, int slots, int data_cap, void (*write)(ring_slot_t* rec)) {
+    if (fopen_s(&writer->file, path, "wb") != 0 || writer->file == NULL) {
+        fprintf(stderr, "[ERROR] Cannot create %s\n", path);
+        writer->file = NULL;
+        return -1;
+    }
+    if (ring_init(&writer->ring, slots, data_cap) != 0) {
+        fprintf(stderr, "[ERROR] Out of memory for the %s ring\n", path);
+        fclose(writer->file);
+        writer->file = NULL;
+        return -1;
+    }
+    setvbuf(writer->file, NULL, _IOFBF, 1 << 20);
+    writer->write = write;
+    return 0;
+}
+
+// Drain a writer's ring to its file; the only thread that writes the file
+DWORD WINAPI ring_writer_thread(LPVOID param) {
+    ring_writer_t* writer = (ring_writer_t*)param;
+    ULONGLONG last_flush = GetTickCount64();
+
+    for (;;) {
+        ring_slot_t* rec = ring_peek(&writer->ring);
+        if (rec == NULL) {
+            if (!writers_running) {
+                break;  // Relay threads are gone and the ring is empty
+            }
+            if (GetTickCount64() - last_flush >= WRITER_FLUSH_MS) {
+                fflush(writer->file);
+                last_flush = GetTickCount64();
+            }
+            Sleep(10);
+            continue;
+        }
+        writer->write(rec);
+        ring_pop(&writer->ring);
+    }
+
+    fflush(writer->file);
+    return 0;
+}
+
+// Wait for the writer to drain (writers_running must already be clear) and close its file
+void ring_writer_close(ring_writer_t* writer) {
+    if (writer->handle != NULL) {
+        WaitForSingleObject(writer->handle, 5000);
+        CloseHandle(writer->handle);
+        writer->handle = NULL;
+    }
+    if (writer->file != NULL) {
+        fclose(writer->file);
+        writer->file = NULL;
+    }
+}
+
+// Queue a capture record for a connection that is being captured. Each record
+// carries its stream offset, so chunks lost to a full ring show up as gaps.
+void capture_record(connection_t* conn, int type, const char* data, int len) {
+    unsigned long long totals[2];
+
+    if (!conn->capture) {
+        return;
+    }
+    if (type == RELAY_IN) {
+        ring_push(&capture_writer.ring, conn, type, (LONG64)conn->capture_in, data, len);
+        conn->capture_in += len;
+    }
+    else if (type == RELAY_OUT) {
+        ring_push(&capture_writer.ring, conn, type, (LONG64)conn->capture_out, data, len);
+        conn->capture_out += len;
+    }
+    else {
+        // The FINs follow the last byte in each direction
+        totals[0] = conn->capture_in;
+        totals[1] = conn->capture_out;
+        ring_push(&capture_writer.ring, conn, type, 0, (const char*)totals, sizeof(totals));
+    }
+}
+
+// Decide whether to capture the connection relayed on socket s and announce its addresses
+void capture_open(connection_t* conn, SOCKET s) {
+    struct sockaddr_storage addrs[2];  // Peer, local
+    int peer_len = sizeof(addrs[0]);
+    int local_len = sizeof(addrs[1]);
+
+    conn->capture = 0;
+    conn->capture_in = 0;
+    conn->capture_out = 0;
+    if (capture_writer.file == NULL) {
+        return;
+    }
+    if (getpeername(s, (struct sockaddr*)&addrs[0], &peer_len) == SOCKET_ERROR ||
+        getsockname(s, (struct sockaddr*)&addrs[1], &local_len) == SOCKET_ERROR) {
+        return;
+    }
+    addr_unmap(&addrs[0]);
+    addr_unmap(&addrs[1]);
+    if (addrs[0].ss_family != addrs[1].ss_family ||
+        (addrs[0].ss_family != AF_INET && addrs[0].ss_family != AF_INET6)) {
+        return;
+    }
+    if (capture_filter != NULL && !ip_matches(&capture_filter_addr, &addrs[0])) {
+        return;
+    }
+
+    // Without its OPEN the writer couldn't place the data, so don't capture at all
+    conn->capture = ring_push(&capture_writer.ring, conn, RELAY_OPEN, 0, (const char*)addrs, sizeof(addrs)) == 0;
+}
+
+// Internet checksum over an IPv4 header
+unsigned short ip_checksum(const unsigned char* p, int len) {
+    unsigned long sum = 0;
+    for (int i = 0; i + 1 < len; i += 2) {
+        sum += (p[i] << 8) | p[i + 1];
+    }
+    while (sum >> 16) {
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    }
+    return (unsigned short)~sum;
+}
+
+// Write one synthesized IPv4/TCP or IPv6/TCP segment as a pcap-ng Enhanced Packet Block
+void capture_write_packet(capture_flow_t* flow, int from_peer, int tcp_flags,
+    const char* data, int len, LONG64 time_us) {
+    static unsigned short ip_id = 0;
+    unsigned char hdr[60];
+    unsigned int block[7];
+    int v6 = flow->peer.ss_family == AF_INET6;
+    int ip_len = v6 ? 40 : 20;
+    unsigned char* tcp = hdr + ip_len;
+    int packet_len = ip_len + 20 + len;
+    int padding = (4 - (packet_len & 3)) & 3;
+    unsigned int total = (unsigned int)(sizeof(block) + packet_len + padding + 4);
+    const struct sockaddr_storage* src = from_peer ? &flow->peer : &flow->local;
+    const struct sockaddr_storage* dst = from_peer ? &flow->local : &flow->peer;
+    int addr_len;
+    unsigned int seq = from_peer ? flow->peer_seq : flow->local_seq;
+    unsigned int ack = from_peer ? flow->local_seq : flow->peer_seq;
+    unsigned short value16;
+    unsigned int value32;
+    u_short port;
+    static const char zeros[4] = { 0 };
+
+    memset(hdr, 0, sizeof(hdr));
+    if (v6) {
+        // IPv6 header: no checksum, no fragmentation fields
+        hdr[0] = 0x60;
+        value16 = htons((unsigned short)(20 + len));
+        memcpy(hdr + 4, &value16, 2);
+        hdr[6] = IPPROTO_TCP;
+        hdr[7] = 64;
+        memcpy(hdr + 8, addr_bytes(src, &addr_len), 16);
+        memcpy(hdr + 24, addr_bytes(dst, &addr_len), 16);
+    }
+    else {
+        // IPv4 header
+        hdr[0] = 0x45;
+        value16 = htons((unsigned short)packet_len);
+        memcpy(hdr + 2, &value16, 2);
+        value16 = htons(ip_id++);
+        memcpy(hdr + 4, &value16, 2);
+        hdr[6] = 0x40;  // Don't fragment
+        hdr[8] = 64;
+        hdr[9] = IPPROTO_TCP;
+        memcpy(hdr + 12, addr_bytes(src, &addr_len), 4);
+        memcpy(hdr + 16, addr_bytes(dst, &addr_len), 4);
+        value16 = htons(ip_checksum(hdr, 20));
+        memcpy(hdr + 10, &value16, 2);
+    }
+
+    // TCP header (checksum left zero; Wireshark doesn't verify it by default)
+    port = addr_port(src);
+    memcpy(tcp, &port, 2);
+    port = addr_port(dst);
+    memcpy(tcp + 2, &port, 2);
+    value32 = htonl(seq);
+    memcpy(tcp + 4, &value32, 4);
+    value32 = htonl(ack);
+    memcpy(tcp + 8, &value32, 4);
+    tcp[12] = 0x50;
+    tcp[13] = (unsigned char)tcp_flags;
+    tcp[14] = 0xFF;
+    tcp[15] = 0xFF;
+
+    block[0] = 6;  // Enhanced Packet Block
+    block[1] = total;
+    block[2] = 0;  // Interface
+    block[3] = (unsigned int)((ULONGLONG)time_us >> 32);
+    block[4] = (unsigned int)time_us;
+    block[5] = (unsigned int)packet_len;
+    block[6] = (unsigned int)packet_len;
+    fwrite(block, sizeof(block), 1, capture_writer.file);
+    fwrite(hdr, ip_len + 20, 1, capture_writer.file);
+    if (len > 0) {
+        fwrite(data, len, 1, capture_writer.file);
+    }
+    fwrite(zeros, padding, 1, capture_writer.file);
+    fwrite(&total, sizeof(total), 1, capture_writer.file);
+
+    if (from_peer) {
+        flow->peer_seq += len + ((tcp_flags & 0x03) ? 1 : 0);  // SYN and FIN take a sequence number
+    }
+    else {
+        flow->local_seq += len + ((tcp_flags & 0x03) ? 1 : 0);
+    }
+    InterlockedIncrement64(&stat_capture_packets);
+}
+
+// Turn one ring record into packets
+void capture_write_record(ring_slot_t* rec) {
+    capture_flow_t* flow = &capture_flows[rec->slot];
+    enum { FIN = 0x01, SYN = 0x02, PSH = 0x08, ACK = 0x10 };
+
+    if (rec->type == RELAY_OPEN) {
+        // Synthesize the handshake so Wireshark follows the stream from its start
+        flow->id = rec->id;
+        memcpy(&flow->peer, rec->data, sizeof(flow->peer));
+        memcpy(&flow->local, rec->data + sizeof(flow->peer), sizeof(flow->local));
+        flow->peer_isn = (unsigned int)(rec->id * 2654435761u);
+        flow->local_isn = ~flow->peer_isn;
+        flow->peer_seq = flow->peer_isn;
+        flow->local_seq = flow->local_isn;
+        capture_write_packet(flow, 1, SYN, NULL, 0, rec->time_us);
+        capture_write_packet(flow, 0, SYN | ACK, NULL, 0, rec->time_us);
+        capture_write_packet(flow, 1, ACK, NULL, 0, rec->time_us);
+        return;
+    }
+
+    if (flow->id != rec->id) {
+        return;  // Connection whose OPEN we never saw
+    }
+
+    if (rec->type == RELAY_CLOSE) {
+        unsigned long long totals[2];
+        memcpy(totals, rec->data, sizeof(totals));
+        flow->peer_seq = flow->peer_isn + 1 + (unsigned int)totals[0];
+        flow->local_seq = flow->local_isn + 1 + (unsigned int)totals[1];
+        capture_write_packet(flow, 1, FIN | ACK, NULL, 0, rec->time_us);
+        capture_write_packet(flow, 0, FIN | ACK, NULL, 0, rec->time_us);
+        capture_write_packet(flow, 1, ACK, NULL, 0, rec->time_us);
+        flow->id = 0;
+        return;
+    }
+
+    // Place the segment at its stream offset; a dropped record leaves a hole before it
+    if (rec->type == RELAY_IN) {
+        flow->peer_seq = flow->peer_isn + 1 + (unsigned int)rec->offset;
+    }
+    else {
+        flow->local_seq = flow->local_isn + 1 + (unsigned int)rec->offset;
+    }
+    capture_write_packet(flow, rec->type == RELAY_IN, PSH | ACK, rec->data, rec->len, rec->time_us);
+}
+
+// Create the capture file and write the section header and interface description
+int capture_init(const char* path) {
+    // Section Header Block: little-endian magic, version 1.0, unknown section length
+    unsigned int shb[7] = { 0x0A0D0D0A, 28, 0x1A2B3C4D, 1, 0xFFFFFFFF, 0xFFFFFFFF, 28 };
+    // Interface Description Block: LINKTYPE_RAW (bare IP packets), no snap length
+    unsigned int idb[5] = { 1, 20, 101, 0, 20 };
+
+    if (ring_writer_open(&capture_writer, path, CAPTURE_RING_SLOTS, BUFFER_SIZE, capture_write_record) != 0) {
+        return -1;
+    }
+    fwrite(shb, sizeof(shb), 1, capture_writer.file);
+    fwrite(idb, sizeof(idb), 1, capture_writer.file);
+    return 0;
+}
+
+// Append a LEB128 varint; returns the bytes used
+int put_varint(unsigned char* p, unsigned long long v) {
+    int n = 0;
+    while (v >= 0x80) {
+        p[n++] = (unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+    p[n++] = (unsigned char)v;
+    return n;
+}
+
+// Serialize one relay event: type, connection id, microseconds since the
+// recording started, and for data events the size (and bytes, if recorded)
+void record_write_event(ring_slot_t* rec) {
+    unsigned char hdr[32];
+    int n = 0;
+    LONG64 t = rec->time_us - record_start_us;
+
+    hdr[n++] = (unsigned char)rec->type;
+    n += put_varint(hdr + n, rec->id);
+    n += put_varint(hdr + n, (unsigned long long)(t > 0 ? t : 0));
+    if (rec->type == RELAY_IN || rec->type == RELAY_OUT) {
+        n += put_varint(hdr + n, (unsigned long long)rec->len);
+    }
+    fwrite(hdr, n, 1, record_writer.file);
+    if (record_payloads && (rec->type == RELAY_IN || rec->type == RELAY_OUT)) {
+        fwrite(rec->data, rec->len, 1, record_writer.file);
+    }
+    InterlockedIncrement64(&stat_record_events);
+}
+
+// Create the recording and write its header
+int record_init(const char* path) {
+    unsigned int hdr[4] = { RECORD_MAGIC, 1, 0, 0 };
+
+    if (ring_writer_open(&record_writer, path, RECORD_RING_SLOTS, BUFFER_SIZE, record_write_event) != 0) {
+        return -1;
+    }
+    record_start_us = now_us();
+    hdr[2] = record_payloads ? RECORD_F_PAYLOAD : 0;
+    fwrite(hdr, sizeof(hdr), 1, record_writer.file);
+    fwrite(&record_start_us, sizeof(record_start_us), 1, record_writer.file);
+    return 0;
+}
+
+// A relayed connection starts on socket s: begin capturing and/or recording it
+void tap_open(connection_t* conn, SOCKET s) {
+    capture_open(conn, s);
+    conn->record = record_writer.file != NULL &&
+        ring_push(&record_writer.ring, conn, RELAY_OPEN, 0, NULL, 0) == 0;
+}
+
+// Pass a relay event to the capture and the recorder
+void tap_event(connection_t* conn, int type, const char* data, int len) {
+    capture_record(conn, type, data, len);
+    if (conn->record) {
+        ring_push(&record_writer.ring, conn, type, 0, record_payloads ? data : NULL, len);
+    }
+}
+
+// Record why a connection is ending, unless an earlier cause already was
+void close_set(connection_t* conn, int reason, int error) {
+    // A stream's up and down threads can both hit a cause; keep the first
+    if (InterlockedCompareExchange(&conn->close_reason, reason, CLOSE_UNKNOWN) == CLOSE_UNKNOWN) {
+        conn->close_error = error;
+    }
+}
+
+// Record a socket failure (or EOF) on one side; only unexpected errors are printed
+void close_as(connection_t* conn, int side, int op, int error) {
+    int kind = close_kind(error);
+    if (kind == CLOSE_ERROR) {
+        fprintf(stderr, "[ERROR] %s() %s %s failed: %d\n", op == CLOSE_OP_SEND ? "send" : "recv",
+            op == CLOSE_OP_SEND ? "to" : "from", side == CLOSE_SIDE_CLIENT ? "client" : side == CLOSE_SIDE_REMOTE ? "remote" : "peer", error);
+    }
+    close_set(conn, CLOSE_REASON(side, op, kind), error);
+}
+
+// Settle the close reason and count it; called once as the connection ends
+void close_finish(connection_t* conn) {
+    close_set(conn, conn->kill_requested ? CLOSE_KILLED : !running ? CLOSE_SHUTDOWN : CLOSE_UNKNOWN, 0);
+    InterlockedIncrement64(&stat_closes[conn->close_reason & 0xFF]);
+}
+
+// Tracepoint: a client was accepted or turned away by the accept loop
+void trace_accept(const struct sockaddr_storage* client_addr, const char* result) {
+    TRACE_EVENT("Accept",
+        TraceLoggingSocketAddress(client_addr, addr_size(client_addr), "Client"),
+        TraceLoggingString(result, "Result"));
+}
+
+// Tracepoint: an upstream connect begun at start (now_us(), 0 if tracing was off) finished
+void trace_connect(const struct sockaddr_storage* client_addr, const char* host, int port, LONG64 start, int error) {
+    TRACE_EVENT("Connect",
+        TraceLoggingSocketAddress(client_addr, addr_size(client_addr), "Client"),
+        TraceLoggingString(host, "Host"),
+        TraceLoggingInt32(port, "Port"),
+        TraceLoggingInt64(start != 0 ? now_us() - start : 0, "DurationUs"),
+        TraceLoggingInt32(error, "Error"));
+}
+
+// Tracepoint: the first chunk relayed from one side ("client" or "remote")
+void trace_first_byte(connection_t* conn, const char* from, int bytes) {
+    TRACE_EVENT("FirstByte",
+        TraceLoggingUInt64(conn->id, "Id"),
+        TraceLoggingString(from, "From"),
+        TraceLoggingInt32(bytes, "Bytes"),
+        TraceLoggingInt64(now_us() - conn->started_us, "SinceStartUs"));
+}
+
+// Tracepoint: a connection ended; the reason is only formatted when a session listens
+void trace_close(connection_t* conn) {
+    if (TRACE_ENABLED()) {
+        char reason[48];
+        format_close_reason(reason, sizeof(reason), conn->close_reason);
+        TRACE_EVENT("Close",
+            TraceLoggingUInt64(conn->id, "Id"),
+            TraceLoggingSocketAddress(&conn->client_addr, addr_size(&conn->client_addr), "Client"),
+            TraceLoggingString(reason, "Reason"),
+            TraceLoggingInt32(conn->close_error, "Error"),
+            TraceLoggingUInt64(conn->bytes_client_to_remote, "BytesIn"),
+            TraceLoggingUInt64(conn->bytes_remote_to_client, "BytesOut"),
+            TraceLoggingUInt64(GetTickCount64() - conn->started, "DurationMs"));
+    }
+}
+
+// Ask a backend's circuit breaker whether a connect may go ahead. While
+// half-open, up to breaker_probes trial connects are let through (*probe = 1).
+int breaker_allow(backend_t* b, int* probe) {
+    int allow = 1;
+
+    *probe = 0;
+    if (breaker_threshold == 0 || b->state == BREAKER_CLOSED) {
+        return 1;
+    }
+
+    EnterCriticalSection(&b->lock);
+    if (b->state == BREAKER_OPEN && GetTickCount64() - b->opened_at >= (ULONGLONG)breaker_cooldown * 1000) {
+        b->state = BREAKER_HALF_OPEN;
+        b->probes = 0;
+    }
+    if (b->state == BREAKER_OPEN) {
+        allow = 0;
+    }
+    else if (b->state == BREAKER_HALF_OPEN) {
+        if (b->probes < breaker_probes) {
+            b->probes++;
+            *probe = 1;
+        }
+        else {
+            allow = 0;
+        }
+    }
+    LeaveCriticalSection(&b->lock);
+
+    if (!allow) {
+        InterlockedIncrement64(&b->fast_fails);
+    }
+    return allow;
+}
+
+// Start a backend's warm-up: its effective weight climbs from WARMUP_MIN_SHARE
+// to full over warmup_seconds, so a cold replica isn't handed a herd at once
+void backend_warm_up(backend_t* b) {
+    if (warmup_seconds > 0 && backend_count > 1) {
+        b->warm_start = GetTickCount64();
+    }
+}
+
+// Share of its full weight a backend gets right now (1.0 unless warming up)
+double backend_ramp(backend_t* b, ULONGLONG now) {
+    ULONGLONG start = b->warm_start;
+    if (start == 0) {
+        return 1.0;
+    }
+    double ramp = (double)(now - start) / (warmup_seconds * 1000.0);
+    if (ramp >= 1.0) {
+        b->warm_start = 0;
+        return 1.0;
+    }
+    return ramp > WARMUP_MIN_SHARE ? ramp : WARMUP_MIN_SHARE;
+}
+
+// Whether new connections may go to b: not taken down and not failing fast.
+// An open breaker whose cool-down has run out counts as usable, so the pickers
+// send it the connect that breaker_allow() turns into a half-open probe.
+int backend_usable(backend_t* b) {
+    if (b->down) {
+        return 0;
+    }
+    return b->state != BREAKER_OPEN ||
+        GetTickCount64() - b->opened_at >= (ULONGLONG)breaker_cooldown * 1000;
+}
+
+// Feed a connect result to the backend's breaker
+void breaker_report(backend_t* b, int ok, int probe) {
+    if (breaker_threshold == 0 || (ok && !probe && b->state == BREAKER_CLOSED && b->failures == 0)) {
+        return;  // The common case: nothing to change
+    }
+
+    EnterCriticalSection(&b->lock);
+    if (probe) {
+        b->probes--;
+    }
+    if (ok) {
+        b->failures = 0;
+        if (b->state != BREAKER_CLOSED) {
+            b->state = BREAKER_CLOSED;
+            backend_warm_up(b);
+            printf("[INFO] Backend %s is accepting connections again, circuit closed\n", b->label);
+        }
+    }
+    else {
+        b->failures++;
+        if (b->state == BREAKER_HALF_OPEN || (b->state == BREAKER_CLOSED && b->failures >= breaker_threshold)) {
+            b->state = BREAKER_OPEN;
+            b->opened_at = GetTickCount64();
+            b->opens++;
+            fprintf(stderr, "[ERROR] Backend %s failed %d connects, circuit open for %d s\n",
+                b->label, b->failures, breaker_cooldown);
+        }
+    }
+    LeaveCriticalSection(&b->lock);
+}
+
+// Fold a latency sample into a peak-EWMA: a slower sample is taken at once so a
+// backend going bad is noticed on its first slow answer, a faster one pulls the
+// average down gradually (time constant EWMA_DECAY_US)
+void ewma_update(LONG64* ewma, LONG64* at, LONG64 sample, LONG64 now) {
+    if (*at == 0 || sample >= *ewma) {
+        *ewma = sample;
+    }
+    else {
+        double w = exp(-(double)(now - *at) / EWMA_DECAY_US);
+        *ewma = (LONG64)((double)*ewma * w + (double)sample * (1.0 - w));
+    }
+    *at = now;
+}
+
+// Connect to a backend through its circuit breaker. Returns INVALID_SOCKET with
+// *error set to the Winsock error, or -1 if the breaker failed it fast.
+SOCKET backend_connect(backend_t* b, const struct sockaddr_storage* client_addr, ULONGLONG deadline, int* error) {
+    int probe;
+
+    if (!breaker_allow(b, &probe)) {
+        *error = -1;
+        return INVALID_SOCKET;
+    }
+
+    LONG64 connect_start = TRACE_ENABLED() || backend_count > 1 ? now_us() : 0;
+    SOCKET s = connect_remote(b->host, b->port, deadline);
+    *error = s == INVALID_SOCKET ? WSAGetLastError() : 0;
+    trace_connect(client_addr, b->host, b->port, connect_start, *error);
+    breaker_report(b, s != INVALID_SOCKET, probe);
+    if (backend_count > 1) {
+        // A refusal is quick, so failures count as a slow sample rather than their real duration
+        LONG64 now = now_us();
+        EnterCriticalSection(&b->lock);
+        ewma_update(&b->ewma_connect_us, &b->ewma_connect_at,
+            s != INVALID_SOCKET ? now - connect_start : EWMA_FAILURE_US, now);
+        LeaveCriticalSection(&b->lock);
+    }
+    if (s != INVALID_SOCKET) {
+        InterlockedIncrement(&b->active);
+    }
+    return s;
+}
+
+// A connection to b has ended
+void backend_done(backend_t* b) {
+    InterlockedDecrement(&b->active);
+}
+
+// The backend answered: record the time since it connected or was last sent a request
+void backend_first_byte(connection_t* conn) {
+    if (conn->ttfb_from_us == 0) {
+        return;
+    }
+    backend_t* b = conn->backend;
+    LONG64 now = now_us();
+    EnterCriticalSection(&b->lock);
+    ewma_update(&b->ewma_ttfb_us, &b->ewma_ttfb_at, now - conn->ttfb_from_us, now);
+    LeaveCriticalSection(&b->lock);
+    conn->ttfb_from_us = 0;
+}
+
+// Expected cost of sending one more connection to b: its decayed latency
+// averages scaled by the connections it already has (peak-EWMA)
+double backend_cost(backend_t* b, LONG64 now) {
+    double latency = 1.0;
+    if (b->ewma_connect_at != 0) {
+        latency += b->ewma_connect_us * exp(-(double)(now - b->ewma_connect_at) / EWMA_DECAY_US);
+    }
+    if (b->ewma_ttfb_at != 0) {
+        latency += b->ewma_ttfb_us * exp(-(double)(now - b->ewma_ttfb_at) / EWMA_DECAY_US);
+    }
+    return latency * (double)(b->active + 1);
+}
+
+// Next value of this thread's xorshift generator
+unsigned int balance_random() {
+    if (balance_seed == 0) {
+        balance_seed = (GetCurrentThreadId() * 2654435761u ^ (unsigned int)GetTickCount64()) | 1;
+    }
+    balance_seed ^= balance_seed << 13;
+    balance_seed ^= balance_seed >> 17;
+    balance_seed ^= balance_seed << 5;
+    return balance_seed;
+}
+
+// Smooth weighted round-robin over the usable backends, each weighted by its
+// warm-up ramp: every pick adds the weights to the credits and the richest
+// backend pays the total back. Falls back to all backends if none is usable.
+// Usability is judged under the lock, so a backend taken down or tripped
+// mid-pick can't leave the scan without a candidate.
+backend_t* backend_pick_round_robin(ULONGLONG now) {
+    backend_t* best = NULL;
+    double total = 0.0;
+
+    EnterCriticalSection(&balance_lock);
+    for (int pass = 0; pass < 2 && best == NULL; pass++) {
+        for (int i = 0; i < primary_count; i++) {
+            backend_t* b = &backends[i];
+            if (pass == 0 && !backend_usable(b)) {
+                continue;
+            }
+            double weight = backend_ramp(b, now);
+            b->rr_current += weight;
+            total += weight;
+            if (best == NULL || b->rr_current > best->rr_current) {
+                best = b;
+            }
+        }
+    }
+    if (best != NULL) {
+        best->rr_current -= total;
+    }
+    LeaveCriticalSection(&balance_lock);
+    return best;
+}
+
+// Hash of an IPv4 address (murmur3 finalizer), so neighbouring clients land far apart
+unsigned int hash_addr(unsigned int x) {
+    x ^= x >> 16;
+    x *= 0x85ebca6b;
+    x ^= x >> 13;
+    x *= 0xc2b2ae35;
+    x ^= x >> 16;
+    return x;
+}
+
+// Hash of a client's IP address, one 32-bit word at a time (IPv4 hashes as before)
+unsigned int hash_client(const struct sockaddr_storage* addr) {
+    int len;
+    const unsigned char* bytes = addr_bytes(addr, &len);
+    unsigned int h = 0;
+    for (int i = 0; i < len; i += 4) {
+        unsigned int word;
+        memcpy(&word, bytes + i, 4);
+        h = hash_addr(h ^ word);
+    }
+    return h;
+}
+
+// FNV-1a of a backend name, varied by seed
+unsigned int hash_name(const char* name, unsigned int seed) {
+    unsigned int h = 2166136261u ^ seed;
+    for (; *name != '\0'; name++) {
+        h = (h ^ (unsigned char)*name) * 16777619u;
+    }
+    return h;
+}
+
+// Fill a Maglev lookup table: each backend walks its own permutation of the
+// slots, derived from its name, and the backends take turns claiming their
+// next free slot. Every backend ends up with an equal share, and a backend
+// joining or leaving moves few other slots.
+void maglev_build(unsigned char* table, const char* const* names, int count) {
+    unsigned int offset[MAX_BACKENDS];
+    unsigned int skip[MAX_BACKENDS];
+    unsigned int next[MAX_BACKENDS];
+    int filled = 0;
+
+    for (int i = 0; i < count; i++) {
+        offset[i] = hash_name(names[i], 0x9747b28c) % MAGLEV_TABLE_SIZE;
+        skip[i] = hash_name(names[i], 0x5bd1e995) % (MAGLEV_TABLE_SIZE - 1) + 1;
+        next[i] = 0;
+    }
+    memset(table, 0xFF, MAGLEV_TABLE_SIZE);
+    while (filled < MAGLEV_TABLE_SIZE) {
+        for (int i = 0; i < count && filled < MAGLEV_TABLE_SIZE; i++) {
+            unsigned int slot;
+            do {
+                slot = (unsigned int)((offset[i] + (unsigned long long)next[i] * skip[i]) % MAGLEV_TABLE_SIZE);
+                next[i]++;
+            } while (table[slot] != 0xFF);
+            table[slot] = (unsigned char)i;
+            filled++;
+        }
+    }
+}
+
+// Hash the client's address to its own backend. With bounded loads, a
+// backend already holding hash_load_factor x the average is passed over, as
+// is one that is down, failing fast or (by chance) still warming up; the
+// search walks on through the table, whose neighbouring slots belong to
+// unrelated backends, so the overflow spreads instead of piling onto one.
+backend_t* backend_pick_hash(const struct sockaddr_storage* client_addr, ULONGLONG now) {
+    unsigned int slot = hash_client(client_addr) % MAGLEV_TABLE_SIZE;
+    LONG total = 0;
+    int usable = 0;
+
+    for (int i = 0; i < primary_count; i++) {
+        if (backend_usable(&backends[i])) {
+            total += backends[i].active;
+            usable++;
+        }
+    }
+    if (usable == 0) {
+        return &backends[maglev_table[slot]];
+    }
+
+    LONG bound = (LONG)ceil(hash_load_factor * (double)(total + 1) / usable);
+    for (int probe = 0; probe < MAGLEV_TABLE_SIZE; probe++) {
+        backend_t* b = &backends[maglev_table[(slot + probe) % MAGLEV_TABLE_SIZE]];
+        if (!backend_usable(b) || b->active >= bound) {
+            continue;
+        }
+        double ramp = backend_ramp(b, now);
+        if (ramp < 1.0 && (balance_random() & 0xFFFF) >= ramp * 65536.0) {
+            continue;
+        }
+        if (probe > 0 && b != &backends[maglev_table[slot]]) {
+            InterlockedIncrement64(&stat_hash_spills);
+        }
+        return b;
+    }
+    return &backends[maglev_table[slot]];
+}
+
+// Measure hash lookups: table build time, cost per lookup, how evenly keys
+// spread, and how many keys move when a backend is removed
+int hash_bench(int count, int lookups) {
+    LARGE_INTEGER freq, start, end;
+    const char* names[MAX_BACKENDS];
+    static unsigned char without_first[MAGLEV_TABLE_SIZE];
+    long long hits[MAX_BACKENDS] = { 0 };
+    struct sockaddr_storage addr;
+    struct sockaddr_in* v4 = (struct sockaddr_in*)&addr;
+
+    if (count < 2 || count > MAX_BACKENDS || lookups < 1) {
+        fprintf(stderr, "[ERROR] --bench-hash expects 2-%d backends and a positive lookup count\n", MAX_BACKENDS);
+        return 1;
+    }
+    for (int i = 0; i < count; i++) {
+        backends[i].port = 5432;
+        snprintf(backends[i].label, sizeof(backends[i].label), "10.0.0.%d:5432", i + 1);
+        names[i] = backends[i].label;
+    }
+    backend_count = count;
+    primary_count = count;
+
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&start);
+    maglev_build(maglev_table, names, count);
+    QueryPerformanceCounter(&end);
+    double build_ms = (double)(end.QuadPart - start.QuadPart) * 1000.0 / (double)freq.QuadPart;
+
+    // Distinct pseudo-random client addresses; loads stay at zero, so this
+    // times the full pick including the bounded-load scan
+    ZeroMemory(&addr, sizeof(addr));
+    v4->sin_family = AF_INET;
+    unsigned int key = 0x12345678;
+    QueryPerformanceCounter(&start);
+    for (int i = 0; i < lookups; i++) {
+        key ^= key << 13;
+        key ^= key >> 17;
+        key ^= key << 5;
+        v4->sin_addr.s_addr = key;
+        hits[backend_pick_hash(&addr, 0) - backends]++;
+    }
+    QueryPerformanceCounter(&end);
+    double lookup_ns = (double)(end.QuadPart - start.QuadPart) * 1e9 / (double)freq.QuadPart / lookups;
+
+    long long fewest = hits[0];
+    long long most = hits[0];
+    for (int i = 1; i < count; i++) {
+        fewest = hits[i] < fewest ? hits[i] : fewest;
+        most = hits[i] > most ? hits[i] : most;
+    }
+
+    // Keys that belonged to the surviving backends should stay put
+    maglev_build(without_first, names + 1, count - 1);
+    long long kept = 0;
+    long long moved = 0;
+    for (unsigned int slot = 0; slot < MAGLEV_TABLE_SIZE; slot++) {
+        if (maglev_table[slot] != 0) {
+            kept++;
+            if (without_first[slot] + 1 != maglev_table[slot]) {
+                moved++;
+            }
+        }
+    }
+
+    printf("[BENCH] backends=%d table=%d build=%.2fms lookups=%d ns_per_lookup=%.1f\n",
+        count, MAGLEV_TABLE_SIZE, build_ms, lookups, lookup_ns);
+    printf("[BENCH] share_min=%.2f%% share_max=%.2f%% even=%.2f%%\n",
+        100.0 * fewest / lookups, 100.0 * most / lookups, 100.0 / count);
+    printf("[BENCH] remove_backend remapped=%.2f%% of other backends' slots\n",
+        kept > 0 ? 100.0 * moved / kept : 0.0);
+    return 0;
+}
+
+// Choose the backend for a new connection. P2C compares two backends drawn at
+// random and takes the cheaper, so a slow replica sheds load without the herd
+// all piling onto whichever one currently looks fastest. Backends that are down
+// or whose breaker is open are passed over while another candidate is usable,
+// and a warming-up backend only keeps a win with probability equal to its ramp.
+backend_t* backend_pick(const struct sockaddr_storage* client_addr) {
+    backend_t* pick;
+
+    if (primary_count == 1) {
+        return &backends[0];
+    }
+
+    ULONGLONG now = GetTickCount64();
+    if (balance_policy == BALANCE_ROUND_ROBIN) {
+        pick = backend_pick_round_robin(now);
+    }
+    else if (balance_policy == BALANCE_HASH) {
+        pick = backend_pick_hash(client_addr, now);
+    }
+    else {
+        unsigned int r = balance_random();
+        int i = (int)(r % primary_count);
+        int j = (i + 1 + (int)((r >> 8) % (primary_count - 1))) % primary_count;
+        backend_t* a = &backends[i];
+        backend_t* b = &backends[j];
+        backend_t* other;
+        if (backend_usable(a) != backend_usable(b)) {
+            pick = backend_usable(a) ? a : b;
+            other = pick;
+        }
+        else {
+            LONG64 clock_us = now_us();
+            pick = backend_cost(b, clock_us) < backend_cost(a, clock_us) ? b : a;
+            other = pick == a ? b : a;
+        }
+        double ramp = backend_ramp(pick, now);
+        if (ramp < 1.0 && (balance_random() & 0xFFFF) >= ramp * 65536.0) {
+            pick = other;
+        }
+    }
+    InterlockedIncrement64(&pick->picks);
+    return pick;
+}
+
+// Connect a client to *backend, moving on to other backends if that fails.
+// Nothing has been relayed yet, so a retry only costs the client a little
+// latency. Other primaries are tried before the fallbacks, up to
+// connect_retries extra attempts within connect_budget_ms. On success
+// *backend is the one that answered.
+SOCKET upstream_connect(backend_t** backend, const struct sockaddr_storage* client_addr, int* error) {
+    ULONGLONG deadline = connect_budget_ms > 0 ? GetTickCount64() + connect_budget_ms : 0;
+    int retries = connect_retries >= 0 ? connect_retries : (backend_count - 1 < 3 ? backend_count - 1 : 3);
+    int tried[MAX_BACKENDS] = { 0 };
+    backend_t* b = *backend;
+
+    for (int attempt = 0; ; attempt++) {
+        SOCKET s = backend_connect(b, client_addr, deadline, error);
+        if (s != INVALID_SOCKET) {
+            if (attempt > 0) {
+                InterlockedIncrement64(&stat_connect_rescued);
+            }
+            *backend = b;
+            return s;
+        }
+        tried[b - backends] = 1;
+        if (attempt == retries || (deadline != 0 && GetTickCount64() >= deadline)) {
+            break;
+        }
+
+        // Next untried backend in list order (primaries come first) that is
+        // neither down nor failing fast
+        backend_t* next = NULL;
+        for (int i = 0; i < backend_count && next == NULL; i++) {
+            if (!tried[i] && backend_usable(&backends[i])) {
+                next = &backends[i];
+            }
+        }
+        if (next == NULL) {
+            break;
+        }
+        printf("[INFO] Connect to %s failed, retrying on %s\n", b->label, next->label);
+        InterlockedIncrement64(&stat_connect_retries);
+        b = next;
+    }
+    *backend = b;
+    return INVALID_SOCKET;
+}
+
+// Writer thread side: records are already in file layout
+void access_log_write(ring_slot_t* rec) {
+    fwrite(rec->data, rec->len, 1, access_writer.file);
+}
+
+// Create the access log and write its header: magic, version, record size and
+// the backend names that records refer to by index
+int access_log_init(const char* path) {
+    unsigned int hdr[4] = { ACCESS_LOG_MAGIC, 2, sizeof(access_record_t), (unsigned int)backend_count };
+
+    if (ring_writer_open(&access_writer, path, ACCESS_RING_SLOTS, (int)sizeof(access_record_t), access_log_write) != 0) {
+        return -1;
+    }
+    fwrite(hdr, sizeof(hdr), 1, access_writer.file);
+    for (int i = 0; i < backend_count; i++) {
+        unsigned short name_len = (unsigned short)strlen(backends[i].label);
+        fwrite(&name_len, sizeof(name_len), 1, access_writer.file);
+        fwrite(backends[i].label, name_len, 1, access_writer.file);
+    }
+    return 0;
+}
+
+// Queue the connection's access record; called once as it closes
+void access_log_close(connection_t* conn) {
+    access_record_t rec;
+
+    ZeroMemory(&rec, sizeof(rec));
+    rec.id = conn->id;
+    rec.start_us = conn->started_us;
+    rec.bytes_in = conn->bytes_client_to_remote;
+    rec.bytes_out = conn->bytes_remote_to_client;
+    rec.duration_ms = (unsigned int)(GetTickCount64() - conn->started);
+    rec.close_error = (unsigned int)conn->close_error;
+    rec.backend = conn->backend != NULL ? (unsigned short)(conn->backend - backends) : 0;
+    rec.close_reason = (unsigned char)conn->close_reason;
+    rec.flags = (conn->tls != NULL ? ACCESS_F_TLS : 0) | (peer_mode != PEER_NONE ? ACCESS_F_TUNNEL : 0);
+    int addr_len;
+    const unsigned char* addr = addr_bytes(&conn->client_addr, &addr_len);
+    if (addr != NULL) {
+        rec.family = conn->client_addr.ss_family == AF_INET6 ? 6 : 4;
+        rec.client_port = ntohs(addr_port(&conn->client_addr));
+        memcpy(rec.client_addr, addr, addr_len);
+    }
+    ring_push(&access_writer.ring, conn, 0, 0, (const char*)&rec, sizeof(rec));
+}
+
+// Offline decoder: print an access log as JSON lines or CSV
+int access_log_decode(const char* path, int csv) {
+    FILE* f;
+    unsigned int hdr[4];
+    char names[ACCESS_MAX_BACKENDS][300];
+    access_record_t rec;
+
+    if (fopen_s(&f, path, "rb") != 0 || f == NULL) {
+        fprintf(stderr, "[ERROR] Cannot open access log %s\n", path);
+        return 1;
+    }
+    if (fread(hdr, sizeof(hdr), 1, f) != 1 || hdr[0] != ACCESS_LOG_MAGIC || hdr[1] != 2 ||
+        hdr[2] != sizeof(access_record_t) || hdr[3] > ACCESS_MAX_BACKENDS) {
+        fprintf(stderr, "[ERROR] %s is not a forwarder access log\n", path);
+        fclose(f);
+        return 1;
+    }
+    for (unsigned int i = 0; i < hdr[3]; i++) {
+        unsigned short name_len;
+        if (fread(&name_len, sizeof(name_len), 1, f) != 1 || name_len >= sizeof(names[i]) ||
+            fread(names[i], 1, name_len, f) != name_len) {
+            fprintf(stderr, "[ERROR] Access log header is truncated\n");
+            fclose(f);
+            return 1;
+        }
+        names[i][name_len] = '\0';
+    }
+
+    if (csv) {
+        printf("id,start,duration_ms,client,client_port,backend,bytes_in,bytes_out,close_reason,close_error,tls,tunnel\n");
+    }
+    while (fread(&rec, sizeof(rec), 1, f) == 1) {
+        char client[INET6_ADDRSTRLEN] = "";
+        char start[32];
+        time_t secs = (time_t)(rec.start_us / 1000000);
+        struct tm tm_utc;
+
+        if (rec.family == 4) {
+            inet_ntop(AF_INET, rec.client_addr, client, sizeof(client));
+        }
+        else if (rec.family == 6) {
+            inet_ntop(AF_INET6, rec.client_addr, client, sizeof(client));
+        }
+        gmtime_s(&tm_utc, &secs);
+        snprintf(start, sizeof(start), "%04d-%02d-%02dT%02d:%02d:%02d.%06dZ",
+            tm_utc.tm_year + 1900, tm_utc.tm_mon + 1, tm_utc.tm_mday,
+            tm_utc.tm_hour, tm_utc.tm_min, tm_utc.tm_sec, (int)(rec.start_us % 1000000));
+        const char* backend = rec.backend < hdr[3] ? names[rec.backend] : "";
+        char reason[48];
+        format_close_reason(reason, sizeof(reason), rec.close_reason);
+
+        if (csv) {
+            printf("%llu,%s,%u,%s,%u,%s,%llu,%llu,%s,%u,%d,%d\n",
+                rec.id, start, rec.duration_ms, client, rec.client_port, backend,
+                rec.bytes_in, rec.bytes_out, reason, rec.close_error,
+                (rec.flags & ACCESS_F_TLS) != 0, (rec.flags & ACCESS_F_TUNNEL) != 0);
+        }
+        else {
+            printf("{\"id\":%llu,\"start\":\"%s\",\"duration_ms\":%u,\"client\":\"%s\",\"client_port\":%u,"
+                "\"backend\":\"%s\",\"bytes_in\":%llu,\"bytes_out\":%llu,\"close_reason\":\"%s\","
+                "\"close_error\":%u,\"tls\":%s,\"tunnel\":%s}\n",
+                rec.id, start, rec.duration_ms, client, rec.client_port, backend,
+                rec.bytes_in, rec.bytes_out, reason, rec.close_error,
+                (rec.flags & ACCESS_F_TLS) ? "true" : "false", (rec.flags & ACCESS_F_TUNNEL) ? "true" : "false");
+        }
+    }
+
+    fclose(f);
+    return 0;
+}
+
+// Take a free connection slot; returns its index or -1 if all are in use
+int alloc_connection(SOCKET client_socket, SOCKET remote_socket, const struct sockaddr_storage* client_addr) {
+    int conn_index = -1;
+
+    EnterCriticalSection(&conn_lock);
+    for (int i = 0; i < MAX_CONNECTIONS; i++) {
+        if (!connections[i].active) {
+            connection_t* conn = &connections[i];
+            conn_index = i;
+            if (conn->thread_handle != NULL) {
+                CloseHandle(conn->thread_handle);  // The slot's previous relay thread has finished
+                conn->thread_handle = NULL;
+            }
+            conn->client_socket = client_socket;
+            conn->remote_socket = remote_socket;
+            conn->tls = NULL;
+            conn->id = (unsigned long long)InterlockedIncrement64(&next_connection_id);
+            conn->mirror_broken = 0;
+            conn->bytes_client_to_remote = 0;
+            conn->bytes_remote_to_client = 0;
+            if (client_addr != NULL) {
+                conn->client_addr = *client_addr;
+            }
+            else {
+                ZeroMemory(&conn->client_addr, sizeof(conn->client_addr));
+            }
+            conn->backend = &backends[0];
+            conn->ttfb_from_us = 0;
+            conn->started = GetTickCount64();
+            conn->last_activity = conn->started;
+            conn->started_us = now_us();
+            conn->close_reason = CLOSE_UNKNOWN;
+            conn->close_error = 0;
+            conn->kill_requested = 0;
+            conn->rate_limit = default_rate_limit;
+            conn->rate_due[0] = 0.0;
+            conn->rate_due[1] = 0.0;
+            conn->active = 1;
+            break;
+        }
+    }
+    LeaveCriticalSection(&conn_lock);
+
+    if (conn_index == -1) {
+        fprintf(stderr, "[ERROR] Maximum connections reached\n");
+    }
+    return conn_index;
+}
+
+// Claim a busy-poll worker slot for the calling relay thread, pinning it to
+// its CPU if asked; returns the slot, or -1 if every worker is taken
+int busy_poll_acquire() {
+    for (;;) {
+        LONG64 taken = busy_poll_slots;
+        int slot = 0;
+        while (slot < busy_poll_workers && (taken & (LONG64)(1ULL << slot)) != 0) {
+            slot++;
+        }
+        if (slot == busy_poll_workers) {
+            return -1;
+        }
+        if (InterlockedCompareExchange64(&busy_poll_slots, taken | (LONG64)(1ULL << slot), taken) == taken) {
+            if (busy_poll_cpu >= 0 && busy_poll_cpu + slot < 64) {
+                SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << (busy_poll_cpu + slot));
+            }
+            return slot;
+        }
+    }
+}
+
+// Give a worker slot back and unpin the thread
+void busy_poll_release(int slot) {
+    if (slot < 0) {
+        return;
+    }
+    if (busy_poll_cpu >= 0) {
+        DWORD_PTR process_mask, system_mask;
+        if (GetProcessAffinityMask(GetCurrentProcess(), &process_mask, &system_mask)) {
+            SetThreadAffinityMask(GetCurrentThread(), process_mask);
+        }
+    }
+    InterlockedAnd64(&busy_poll_slots, ~(LONG64)(1ULL << slot));
+}
+
+// Charge bytes relayed in one direction against the connection's rate limit.
+// Only the thread relaying that direction touches its clock, so no lock is needed.
+void rate_limit_charge(connection_t* conn, int dir, int bytes) {
+    LONG limit = conn->rate_limit;
+    if (limit <= 0) {
+        return;
+    }
+    double now = (double)GetTickCount64();
+    if (conn->rate_due[dir] < now) {
+        conn->rate_due[dir] = now;  // Idle time doesn't bank a burst
+    }
+    conn->rate_due[dir] += (double)bytes * 1000.0 / (double)limit;
+}
+
+// Milliseconds until a direction is back under its rate limit (0 = may relay now)
+DWORD rate_limit_delay(connection_t* conn, int dir) {
+    if (conn->rate_limit <= 0) {
+        return 0;
+    }
+    double wait = conn->rate_due[dir] - (double)GetTickCount64();
+    return wait >= 1.0 ? (DWORD)wait : 0;
+}
+
+// Pace a tunnel stream thread, which relays a single direction. The wait is
+// slept in short slices so a kill, teardown or shutdown isn't held up by it.
+void rate_limit_wait(connection_t* conn, int dir, int bytes) {
+    DWORD wait;
+    rate_limit_charge(conn, dir, bytes);
+    while ((wait = rate_limit_delay(conn, dir)) > 0 &&
+        running && conn->active && !conn->kill_requested && !conn->closing) {
+        Sleep(wait < RATE_LIMIT_SLICE_MS ? wait : RATE_LIMIT_SLICE_MS);
+    }
+}
+
+// Forward data bidirectionally between two sockets
+DWORD WINAPI forward_thread(LPVOID param) {
+    connection_t* conn = (connection_t*)param;
+    SOCKET client = conn->client_socket;
+    SOCKET remote = INVALID_SOCKET;
+
+    fd_set readfds;
+    char buffer[BUFFER_SIZE];
+    int max_fd;
+    struct timeval timeout;
+    unsigned long long stage_start;
+    int spin_slot = -1;
+    unsigned long long spin_start = 0;  // TSC when the current spin began (0 = sleeping in select)
+    unsigned long long spin_limit = 0;
+
+    conn->capture = 0;
+    conn->record = 0;
+
+    // The client socket may already carry options from the listener
+    configure_socket(client, LEG_CLIENT, SOCKOPT_ALL & ~listener_inherited);
+
+    // Terminate TLS on the client leg first, so failed handshakes, scanners
+    // and plaintext clients never cost a backend connect
+    if (conn->tls != NULL) {
+        stage_start = profile_begin();
+        if (tls_accept(conn->tls, client) != 0) {
+            close_set(conn, CLOSE_REASON(CLOSE_SIDE_CLIENT, CLOSE_OP_SETUP, CLOSE_TLS), 0);
+            goto cleanup_thread;
+        }
+        profile_end(STAGE_TLS, stage_start);
+    }
+
+    // Connect upstream here rather than on the accept thread, so a dead
+    // backend's retries and timeouts never hold up accepting other clients
+    backend_t* backend = backend_pick(&conn->client_addr);
+    int error;
+    remote = upstream_connect(&backend, &conn->client_addr, &error);
+    conn->backend = backend;  // The last one tried, for the close record if all failed
+    if (remote == INVALID_SOCKET) {
+        close_set(conn, CLOSE_REASON(CLOSE_SIDE_REMOTE, CLOSE_OP_SETUP, close_kind(error)), error > 0 ? error : 0);
+        goto cleanup_thread;
+    }
+    conn->remote_socket = remote;
+    conn->ttfb_from_us = backend_count > 1 ? now_us() : 0;
+
+    printf("[INFO] Connected to remote %s\n", backend->label);
+
+    // The remote socket is fresh from socket(), so it is already blocking
+    configure_socket(remote, LEG_REMOTE, SOCKOPT_ALL & ~SOCKOPT_BLOCKING);
+
+    // Captured payloads are what the client sent and received, after TLS
+    tap_open(conn, client);
+
+    printf("[INFO] Connection established, forwarding traffic...\n");
+
+    // Busy-poll mode: spin on zero-timeout select() while traffic is flowing
+    if (busy_poll_us > 0) {
+        spin_slot = busy_poll_acquire();
+        spin_limit = (unsigned long long)((double)busy_poll_us * profile_tsc_per_us);
+        spin_start = spin_slot >= 0 ? __rdtsc() : 0;
+    }
+
+    while (running && conn->active && !conn->kill_requested) {
+        // A direction over its rate limit isn't read until it has paid off the
+        // debt; the select() timeout wakes us then, and the other direction
+        // keeps flowing meanwhile
+        DWORD up_wait = rate_limit_delay(conn, 0);
+        DWORD down_wait = rate_limit_delay(conn, 1);
+        DWORD wait_ms = 1000;
+        if (up_wait > 0 && up_wait < wait_ms) {
+            wait_ms = up_wait;
+        }
+        if (down_wait > 0 && down_wait < wait_ms) {
+            wait_ms = down_wait;
+        }
+        if (up_wait > 0 && down_wait > 0) {
+            Sleep(wait_ms);  // select() rejects empty sets
+            continue;
+        }
+
+        FD_ZERO(&readfds);
+        if (up_wait == 0) {
+            FD_SET(client, &readfds);
+        }
+        if (down_wait == 0) {
+            FD_SET(remote, &readfds);
+        }
+
+        // Calculate max fd (Windows doesn't use this but keep for portability reference)
+        max_fd = (client > remote ? client : remote) + 1;
+
+        // Wait for data with timeout (don't wait if TLS already buffered a record)
+        int client_pending = up_wait == 0 && conn->tls != NULL && tls_pending(conn->tls);
+        timeout.tv_sec = client_pending || spin_start != 0 ? 0 : wait_ms / 1000;
+        timeout.tv_usec = client_pending || spin_start != 0 ? 0 : (wait_ms % 1000) * 1000;
+
+        int result = select(max_fd, &readfds, NULL, NULL, &timeout);
+
+        if (result == SOCKET_ERROR) {
+            print_error("select() failed");
+            close_set(conn, CLOSE_ERROR, WSAGetLastError());
+            break;
+        }
+
+        if (spin_start != 0) {
+            unsigned long long spun = __rdtsc() - spin_start;
+            if (result == 0 && !client_pending) {
+                if (spun < spin_limit) {
+                    YieldProcessor();
+                    continue;
+                }
+                // Idle for the whole interval: back off to sleeping until traffic resumes
+                InterlockedIncrement64(&stat_busy_poll_sleeps);
+                InterlockedAdd64(&stat_busy_poll_cycles, (LONG64)spun);
+                spin_start = 0;
+                continue;
+            }
+            InterlockedIncrement64(&stat_busy_poll_hits);
+            InterlockedAdd64(&stat_busy_poll_cycles, (LONG64)spun);
+        }
+
+        if (result == 0 && !client_pending) {
+            // Timeout: check the idle limit, then loop to check the running flag
+            if (idle_timeout > 0 && GetTickCount64() - conn->last_activity >= (ULONGLONG)idle_timeout * 1000) {
+                close_set(conn, CLOSE_IDLE, 0);
+                break;
+            }
+            continue;
+        }
+
+        // Client -> Remote
+        if (client_pending || FD_ISSET(client, &readfds)) {
+            stage_start = profile_begin();
+            int bytes_received = conn->tls != NULL ?
+                tls_recv(conn->tls, client, FD_ISSET(client, &readfds), buffer, BUFFER_SIZE) :
+                recv(client, buffer, BUFFER_SIZE, 0);
+
+            if (bytes_received == SOCKET_ERROR && conn->tls != NULL && WSAGetLastError() == WSAEWOULDBLOCK) {
+                // Only part of a TLS record so far; it stays buffered until select() sees more
+                profile_end(STAGE_RELAY, stage_start);
+            }
+            else if (bytes_received <= 0) {
+                close_as(conn, CLOSE_SIDE_CLIENT, CLOSE_OP_RECV, bytes_received == 0 ? 0 : WSAGetLastError());
+                break;
+            }
+            else {
+                // Forward all data to remote
+                int total_sent = 0;
+                while (total_sent < bytes_received) {
+                    int bytes_sent = send(remote, buffer + total_sent,
+                        bytes_received - total_sent, 0);
+
+                    if (bytes_sent == SOCKET_ERROR) {
+                        close_as(conn, CLOSE_SIDE_REMOTE, CLOSE_OP_SEND, WSAGetLastError());
+                        goto cleanup_thread;
+                    }
+                    total_sent += bytes_sent;
+                }
+                if (conn->bytes_client_to_remote == 0) {
+                    trace_first_byte(conn, "client", bytes_received);
+                    if (conn->ttfb_from_us != 0 && conn->bytes_remote_to_client == 0) {
+                        conn->ttfb_from_us = now_us();  // Client speaks first: time the backend's answer
+                    }
+                }
+                conn->bytes_client_to_remote += bytes_received;
+                conn->last_activity = GetTickCount64();
+                mirror_enqueue(conn, MIRROR_DATA, buffer, bytes_received);
+                profile_end(STAGE_RELAY, stage_start);
+                stage_start = profile_begin();
+                tap_event(conn, RELAY_IN, buffer, bytes_received);
+                profile_end(STAGE_LOG, stage_start);
+                rate_limit_charge(conn, 0, bytes_received);
+            }
+        }
+
+        // Remote -> Client
+        if (FD_ISSET(remote, &readfds)) {
+            stage_start = profile_begin();
+            int bytes_received = recv(remote, buffer, BUFFER_SIZE, 0);
+
+            if (bytes_received <= 0) {
+                close_as(conn, CLOSE_SIDE_REMOTE, CLOSE_OP_RECV, bytes_received == 0 ? 0 : WSAGetLastError());
+                break;
+            }
+
+            // Forward all data to client
+            int total_sent = 0;
+            while (total_sent < bytes_received) {
+                int bytes_sent = conn->tls != NULL ?
+                    tls_send(conn->tls, client, buffer + total_sent, bytes_received - total_sent) :
+                    send(client, buffer + total_sent, bytes_received - total_sent, 0);
+
+                if (bytes_sent == SOCKET_ERROR) {
+                    close_as(conn, CLOSE_SIDE_CLIENT, CLOSE_OP_SEND, WSAGetLastError());
+                    goto cleanup_thread;
+                }
+                total_sent += bytes_sent;
+            }
+            if (conn->bytes_remote_to_client == 0) {
+                trace_first_byte(conn, "remote", bytes_received);
+                backend_first_byte(conn);
+            }
+            conn->bytes_remote_to_client += bytes_received;
+            conn->last_activity = GetTickCount64();
+            profile_end(STAGE_RELAY, stage_start);
+            stage_start = profile_begin();
+            tap_event(conn, RELAY_OUT, buffer, bytes_received);
+            profile_end(STAGE_LOG, stage_start);
+            rate_limit_charge(conn, 1, bytes_received);
+        }
+
+        // Traffic is flowing: (re)start spinning
+        if (spin_slot >= 0) {
+            spin_start = __rdtsc();
+        }
+    }
+
+cleanup_thread:
+    busy_poll_release(spin_slot);
+    mirror_enqueue(conn, MIRROR_CLOSE, NULL, 0);
+    stage_start = profile_begin();
+    tap_event(conn, RELAY_CLOSE, NULL, 0);
+    close_finish(conn);
+    trace_close(conn);
+    if (access_log_path != NULL) {
+        access_log_close(conn);  // Replaces the free-text close line
+    }
+    else {
+        char reason[48];
+        format_close_reason(reason, sizeof(reason), conn->close_reason);
+        printf("[INFO] Closing connection: %s (Sent: %llu bytes, Received: %llu bytes, Total: %llu bytes)\n",
+            reason, conn->bytes_client_to_remote, conn->bytes_remote_to_client,
+            conn->bytes_client_to_remote + conn->bytes_remote_to_client);
+    }
+    profile_end(STAGE_LOG, stage_start);
+    profile_flush();
+
+    if (conn->tls != NULL) {
+        tls_session_close(conn->tls, client);
+        conn->tls = NULL;
+    }
+
+    // Graceful shutdown
+    shutdown(client, SD_BOTH);
+    closesocket(client);
+    if (remote != INVALID_SOCKET) {
+        shutdown(remote, SD_BOTH);
+        closesocket(remote);
+        backend_done(conn->backend);
+    }
+
+    EnterCriticalSection(&conn_lock);
+    conn->active = 0;
+    LeaveCriticalSection(&conn_lock);
+
+    return 0;
+}
+
+// Minimal LZ4 block compressor (greedy, single hash probe). Returns the
+// compressed size, or 0 if the output would not fit in dst_cap; callers pass
+// a cap below the input size so incompressible data fails fast.
+int lz4_compress(const unsigned char* src, int src_len, unsigned char* dst, int dst_cap) {
+    unsigned short table[1 << LZ4_HASH_LOG];
+    const unsigned char* ip = src;
+    const unsigned char* anchor = src;
+    const unsigned char* end = src + src_len;
+    const unsigned char* mflimit = end - 12;    // Last match must start 12 bytes before the end
+    const unsigned char* matchlimit = end - 5;  // and leave at least 5 trailing literals
+    unsigned char* op = dst;
+    unsigned char* oend = dst + dst_cap;
+    int lit;
+
+    memset(table, 0, sizeof(table));
+
+    if (src_len > 12) {
+        while (ip < mflimit) {
+            unsigned int seq;
+            memcpy(&seq, ip, 4);
+            unsigned int h = (seq * 2654435761u) >> (32 - LZ4_HASH_LOG);
+            const unsigned char* ref = src + table[h];
+            table[h] = (unsigned short)(ip - src);
+
+            if (ref >= ip || memcmp(ref, ip, 4) != 0) {
+                ip++;
+                continue;
+            }
+
+            // Extend the match backwards into pending literals, then forwards
+            while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            const unsigned char* m = ip + 4;
+            const unsigned char* r = ref + 4;
+            while (m < matchlimit && *m == *r) {
+                m++;
+                r++;
+            }
+
+            lit = (int)(ip - anchor);
+            int mlen = (int)(m - ip) - 4;
+            if (op + 1 + lit + lit / 255 + 1 + 2 + mlen / 255 + 1 > oend) {
+                return 0;
+            }
+
+            unsigned char* token = op++;
+            if (lit >= 15) {
+                int l = lit - 15;
+                *token = 15 << 4;
+                for (; l >= 255; l -= 255) *op++ = 255;
+                *op++ = (unsigned char)l;
+            }
+            else {
+                *token = (unsigned char)(lit << 4);
+            }
+            memcpy(op, anchor, lit);
+            op += lit;
+
+            int offset = (int)(ip - ref);
+            *op++ = (unsigned char)offset;
+            *op++ = (unsigned char)(offset >> 8);
+
+            if (mlen >= 15) {
+                int l = mlen - 15;
+                *token |= 15;
+                for (; l >= 255; l -= 255) *op++ = 255;
+                *op++ = (unsigned char)l;
+            }
+            else {
+                *token |= (unsigned char)mlen;
+            }
+
+            ip = m;
+            anchor = ip;
+        }
+    }
+
+    // Trailing literals
+    lit = (int)(end - anchor);
+    if (op + 1 + lit + lit / 255 + 1 > oend) {
+        return 0;
+    }
+    if (lit >= 15) {
+        int l = lit - 15;
+        *op++ = 15 << 4;
+        for (; l >= 255; l -= 255) *op++ = 255;
+        *op++ = (unsigned char)l;
+    }
+    else {
+        *op++ = (unsigned char)(lit << 4);
+    }
+    memcpy(op, anchor, lit);
+    op += lit;
+
+    return (int)(op - dst);
+}
+
+// LZ4 block decompressor with bounds checks on every field; returns the
+// decompressed size or -1 on malformed input
+int lz4_decompress(const unsigned char* src, int src_len, unsigned char* dst, int dst_cap) {
+    const unsigned char* ip = src;
+    const unsigned char* iend = src + src_len;
+    unsigned char* op = dst;
+    unsigned char* oend = dst + dst_cap;
+
+    while (ip < iend) {
+        int token = *ip++;
+        int lit = token >> 4;
+        if (lit == 15) {
+            int b;
+            do {
+                if (ip >= iend) return -1;
+                b = *ip++;
+                lit += b;
+            } while (b == 255);
+        }
+        if (lit > iend - ip || lit > oend - op) {
+            return -1;
+        }
+        memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+
+        if (ip >= iend) {
+            break;  // The last sequence has literals only
+        }
+
+        if (iend - ip < 2) {
+            return -1;
+        }
+        int offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > op - dst) {
+            return -1;
+        }
+
+        int mlen = token & 15;
+        if (mlen == 15) {
+            int b;
+            do {
+                if (ip >= iend) return -1;
+                b = *ip++;
+                mlen += b;
+            } while (b == 255);
+        }
+        mlen += 4;
+        if (mlen > oend - op) {
+            return -1;
+        }
+
+        // Byte copy: matches may overlap their own output
+        const unsigned char* match = op - offset;
+        while (mlen-- > 0) {
+            *op++ = *match++;
+        }
+    }
+
+    return (int)(op - dst);
+}
+
+// Receive exactly len bytes; returns 0 on success, -1 on close or error
+int recv_exact(SOCKET s, char* buf, int len) {
+    int total = 0;
+    while (total < len) {
+        int n = recv(s, buf + total, len - total, 0);
+        if (n <= 0) {
+            return -1;
+        }
+        total += n;
+    }
+    return 0;
+}
+
+// Big-endian field helpers for frame headers
+void put_be32(unsigned char* p, unsigned int v) {
+    p[0] = (unsigned char)(v >> 24);
+    p[1] = (unsigned char)(v >> 16);
+    p[2] = (unsigned char)(v >> 8);
+    p[3] = (unsigned char)v;
+}
+
+unsigned int get_be32(const unsigned char* p) {
+    return ((unsigned int)p[0] << 24) | ((unsigned int)p[1] << 16) | ((unsigned int)p[2] << 8) | p[3];
+}
+
+// Send one frame; frames from different streams interleave on a link but never split
+int mux_send_frame(mux_link_t* link, unsigned int stream_id, int type, int flags,
+    unsigned int seq, const char* payload, int len) {
+    unsigned char header[MUX_FRAME_HEADER];
+    WSABUF bufs[2];
+    DWORD sent;
+    int result = SOCKET_ERROR;
+
+    put_be32(header, stream_id);
+    header[4] = (unsigned char)type;
+    header[5] = (unsigned char)flags;
+    header[6] = (unsigned char)(len >> 8);
+    header[7] = (unsigned char)len;
+    put_be32(header + 8, seq);
+
+    bufs[0].buf = (CHAR*)header;
+    bufs[0].len = MUX_FRAME_HEADER;
+    bufs[1].buf = (CHAR*)payload;
+    bufs[1].len = len;
+
+    EnterCriticalSection(&link->send_lock);
+    if (link->up) {
+        result = WSASend(link->socket, bufs, len > 0 ? 2 : 1, &sent, 0, NULL, NULL);
+        if (result == SOCKET_ERROR) {
+            // Wake the reader so it tears the link down
+            shutdown(link->socket, SD_BOTH);
+        }
+    }
+    LeaveCriticalSection(&link->send_lock);
+
+    return result == SOCKET_ERROR ? -1 : 0;
+}
+
+// Find the stream a frame belongs to and lock it; returns NULL if it is gone
+connection_t* mux_lock_stream(ULONGLONG session_id, unsigned int stream_id) {
+    for (int i = 0; i < MAX_CONNECTIONS; i++) {
+        connection_t* conn = &connections[i];
+        if (conn->link == NULL || conn->session_id != session_id || conn->stream_id != stream_id) {
+            continue;
+        }
+        // Re-check under the stream lock; the slot may have been released meanwhile
+        EnterCriticalSection(&conn->stream_lock);
+        if (conn->active && conn->link != NULL && conn->session_id == session_id &&
+            conn->stream_id == stream_id) {
+            return conn;
+        }
+        LeaveCriticalSection(&conn->stream_lock);
+    }
+    return NULL;
+}
+
+// Claim a connection slot for a stream bound to link; returns the slot index or -1
+int mux_alloc_stream(mux_link_t* link, unsigned int stream_id, int flags, SOCKET client_socket,
+    const struct sockaddr_storage* client_addr) {
+    int conn_index = alloc_connection(client_socket, INVALID_SOCKET, client_addr);
+    if (conn_index == -1) {
+        return -1;
+    }
+
+    connection_t* conn = &connections[conn_index];
+
+    // Receive rings are kept for the life of the process so a late frame never
+    // hits freed memory; they only grow if a peer negotiates a larger window
+    if (conn->rx_cap < link->window) {
+        char* rx_buf = (char*)malloc(link->window);
+        if (rx_buf == NULL) {
+            fprintf(stderr, "[ERROR] Out of memory for stream buffer\n");
+            EnterCriticalSection(&conn_lock);
+            conn->active = 0;
+            LeaveCriticalSection(&conn_lock);
+            return -1;
+        }
+        EnterCriticalSection(&conn->stream_lock);
+        free(conn->rx_buf);
+        conn->rx_buf = rx_buf;
+        conn->rx_cap = link->window;
+        LeaveCriticalSection(&conn->stream_lock);
+    }
+
+    EnterCriticalSection(&conn->stream_lock);
+    conn->link = link;
+    conn->session_id = link->session_id;
+    conn->stream_id = stream_id;
+    conn->striped = (flags & MUX_F_STRIPED) != 0;
+    conn->peer_known = peer_mode == PEER_EXIT;  // The entry side opened it before sending OPEN
+    conn->compress = (flags & MUX_F_COMPRESS) != 0;
+    conn->lz4_skip = 0;
+    conn->lz4_backoff = 8;
+    conn->rx_window = link->window;
+    conn->rx_start = 0;
+    conn->rx_len = 0;
+    conn->send_window = link->window;
+    conn->tx_seq = 0;
+    conn->rx_seq = 0;
+    conn->rx_pending = NULL;
+    conn->rx_pending_bytes = 0;
+    conn->stripe_next = (int)(link - mux_links);
+    conn->close_pending = 0;
+    conn->peer_closed = 0;
+    conn->closing = 0;
+    conn->down_handle = NULL;
+    ResetEvent(conn->rx_event);
+    ResetEvent(conn->tx_event);
+    LeaveCriticalSection(&conn->stream_lock);
+
+    InterlockedIncrement(&link->streams);
+    InterlockedIncrement64(&stat_mux_streams);
+    return conn_index;
+}
+
+// Unbind a stream from its link and free the slot
+void mux_release_stream(connection_t* conn) {
+    EnterCriticalSection(&conn->stream_lock);
+    InterlockedDecrement(&conn->link->streams);
+    conn->link = NULL;
+    while (conn->rx_pending != NULL) {
+        mux_chunk_t* chunk = conn->rx_pending;
+        conn->rx_pending = chunk->next;
+        free(chunk);
+    }
+    conn->rx_pending_bytes = 0;
+    LeaveCriticalSection(&conn->stream_lock);
+
+    EnterCriticalSection(&conn_lock);
+    conn->active = 0;
+    LeaveCriticalSection(&conn_lock);
+}
+
+// Pick the link for a stream's next DATA frame: its home link, or the next
+// live link of the session when striping. OPEN only travels on the home link,
+// so until the peer has answered on the stream a frame sent elsewhere could
+// overtake it and be dropped as belonging to no stream.
+mux_link_t* mux_data_link(connection_t* conn) {
+    if (!conn->striped || !conn->peer_known) {
+        return conn->link;
+    }
+    for (int i = 0; i < MUX_MAX_LINKS; i++) {
+        int index = (conn->stripe_next + i) % MUX_MAX_LINKS;
+        mux_link_t* link = &mux_links[index];
+        if (link->up && link->session_id == conn->session_id) {
+            conn->stripe_next = index + 1;
+            return link;
+        }
+    }
+    return conn->link;
+}
+
+// Send one DATA frame, compressed when the stream allows it and it pays off
+int mux_send_chunk(connection_t* conn, const char* data, int len) {
+    unsigned char packed[MUX_MAX_PAYLOAD];
+    int flags = 0;
+    const char* payload = data;
+    int payload_len = len;
+
+    if (conn->compress) {
+        if (conn->lz4_skip > 0) {
+            // Recently incompressible (already-compressed or encrypted data): don't burn CPU
+            conn->lz4_skip--;
+            InterlockedIncrement64(&stat_lz4_bypassed);
+        }
+        else {
+            int packed_len = lz4_compress((const unsigned char*)data, len, packed,
+                len * (100 - LZ4_MIN_SAVING) / 100);
+            if (packed_len > 0) {
+                flags = MUX_F_LZ4;
+                payload = (const char*)packed;
+                payload_len = packed_len;
+                conn->lz4_backoff = 8;
+            }
+            else {
+                conn->lz4_skip = conn->lz4_backoff;
+                if (conn->lz4_backoff < LZ4_MAX_BYPASS) {
+                    conn->lz4_backoff *= 2;
+                }
+                InterlockedIncrement64(&stat_lz4_bypassed);
+            }
+        }
+        InterlockedAdd64(&stat_lz4_raw_bytes, len);
+        InterlockedAdd64(&stat_lz4_wire_bytes, payload_len);
+    }
+
+    return mux_send_frame(mux_data_link(conn), conn->stream_id, MUX_DATA, flags,
+        conn->tx_seq++, payload, payload_len);
+}
+
+// Send data on a stream, waiting for window credit from the peer
+int mux_send_data(connection_t* conn, const char* data, int len) {
+    while (len > 0) {
+        EnterCriticalSection(&conn->stream_lock);
+        int window = conn->send_window;
+        LeaveCriticalSection(&conn->stream_lock);
+
+        if (window <= 0) {
+            if (conn->peer_closed || conn->closing || !running) {
+                return -1;
+            }
+            WaitForSingleObject(conn->tx_event, 1000);
+            continue;
+        }
+
+        int chunk = len < window ? len : window;
+        if (chunk > MUX_MAX_PAYLOAD) {
+            chunk = MUX_MAX_PAYLOAD;
+        }
+
+        EnterCriticalSection(&conn->stream_lock);
+        conn->send_window -= chunk;
+        LeaveCriticalSection(&conn->stream_lock);
+
+        // Window credit counts uncompressed bytes, which is what the receiver buffers
+        if (mux_send_chunk(conn, data, chunk) != 0) {
+            return -1;
+        }
+        data += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+
+// Append in-order data to a stream's receive ring (stream lock held)
+void mux_ring_append(connection_t* conn, const char* data, int len) {
+    int tail = (conn->rx_start + conn->rx_len) % conn->rx_cap;
+    int first = len < conn->rx_cap - tail ? len : conn->rx_cap - tail;
+    memcpy(conn->rx_buf + tail, data, first);
+    memcpy(conn->rx_buf, data + first, len - first);
+    conn->rx_len += len;
+}
+
+// Deliver a DATA frame, reordering striped frames by sequence number (stream lock held)
+int mux_deliver_data(connection_t* conn, unsigned int seq, const char* data, int len) {
+    // The sender never has more than the window outstanding, ordered or not
+    if (conn->rx_len + conn->rx_pending_bytes + len > conn->rx_window) {
+        fprintf(stderr, "[ERROR] Peer overran the window on stream %u\n", conn->stream_id);
+        return -1;
+    }
+
+    if (seq != conn->rx_seq) {
+        // Ahead of a gap: park it in sequence order until the gap fills
+        mux_chunk_t* chunk = (mux_chunk_t*)malloc(sizeof(mux_chunk_t) + len);
+        if (chunk == NULL) {
+            fprintf(stderr, "[ERROR] Out of memory reordering stream %u\n", conn->stream_id);
+            return -1;
+        }
+        chunk->seq = seq;
+        chunk->len = len;
+        memcpy(chunk->data, data, len);
+
+        mux_chunk_t** pos = &conn->rx_pending;
+        while (*pos != NULL && (int)((*pos)->seq - seq) < 0) {
+            pos = &(*pos)->next;
+        }
+        chunk->next = *pos;
+        *pos = chunk;
+        conn->rx_pending_bytes += len;
+        return 0;
+    }
+
+    mux_ring_append(conn, data, len);
+    conn->rx_seq++;
+
+    // Release any parked frames that are now in order
+    while (conn->rx_pending != NULL && conn->rx_pending->seq == conn->rx_seq) {
+        mux_chunk_t* chunk = conn->rx_pending;
+        conn->rx_pending = chunk->next;
+        conn->rx_pending_bytes -= chunk->len;
+        mux_ring_append(conn, chunk->data, chunk->len);
+        conn->rx_seq++;
+        free(chunk);
+    }
+
+    // A CLOSE that overtook the tail of a striped stream takes effect now
+    if (conn->close_pending && conn->rx_seq == conn->close_seq) {
+        conn->peer_closed = 1;
+        SetEvent(conn->tx_event);
+    }
+    return 0;
+}
+
+// Drain data received from the peer to the local socket and return window credit
+DWORD WINAPI stream_down_thread(LPVOID param) {
+    connection_t* conn = (connection_t*)param;
+    SOCKET local = peer_mode == PEER_ENTRY ? conn->client_socket : conn->remote_socket;
+    unsigned long long* counter = peer_mode == PEER_ENTRY ?
+        &conn->bytes_remote_to_client : &conn->bytes_client_to_remote;
+    char buffer[BUFFER_SIZE];
+    int credit = 0;
+
+    for (;;) {
+        int n = 0;
+        int done;
+
+        EnterCriticalSection(&conn->stream_lock);
+        if (conn->rx_len > 0) {
+            // Copy out the contiguous part of the ring
+            n = conn->rx_len;
+            if (n > BUFFER_SIZE) n = BUFFER_SIZE;
+            if (n > conn->rx_cap - conn->rx_start) n = conn->rx_cap - conn->rx_start;
+            memcpy(buffer, conn->rx_buf + conn->rx_start, n);
+            conn->rx_start = (conn->rx_start + n) % conn->rx_cap;
+            conn->rx_len -= n;
+        }
+        done = n == 0 && (conn->peer_closed || conn->closing || !running);
+        LeaveCriticalSection(&conn->stream_lock);
+
+        if (done) {
+            break;
+        }
+        if (n == 0) {
+            WaitForSingleObject(conn->rx_event, 1000);
+            continue;
+        }
+
+        unsigned long long stage_start = profile_begin();
+        if (send_all(local, buffer, n) == SOCKET_ERROR) {
+            close_as(conn, peer_mode == PEER_ENTRY ? CLOSE_SIDE_CLIENT : CLOSE_SIDE_REMOTE,
+                CLOSE_OP_SEND, WSAGetLastError());
+            conn->closing = 1;
+            break;
+        }
+        if (*counter == 0) {
+            trace_first_byte(conn, peer_mode == PEER_ENTRY ? "remote" : "client", n);
+            if (conn->ttfb_from_us != 0 && conn->bytes_remote_to_client == 0) {
+                conn->ttfb_from_us = now_us();  // Client speaks first: time the backend's answer
+            }
+        }
+        *counter += n;
+        conn->last_activity = GetTickCount64();
+        profile_end(STAGE_RELAY, stage_start);
+        stage_start = profile_begin();
+        tap_event(conn, RELAY_OUT, buffer, n);
+        profile_end(STAGE_LOG, stage_start);
+        rate_limit_wait(conn, 1, n);
+
+        // Return credit in batches; while we hold it back the sender still has
+        // at least 3/4 of the window, so it can never stall on withheld credit
+        credit += n;
+        if (credit >= conn->rx_window / 4) {
+            unsigned char payload[4];
+            put_be32(payload, (unsigned int)credit);
+            mux_send_frame(conn->link, conn->stream_id, MUX_WINDOW_UPDATE, 0, 0, (const char*)payload, 4);
+            credit = 0;
+        }
+    }
+
+    // Pass the peer's close on so the local side sees EOF after the last byte
+    if (conn->peer_closed) {
+        shutdown(local, SD_SEND);
+    }
+    conn->closing = 1;
+    profile_flush();
+    return 0;
+}
+
+// Relay one stream: local socket -> peer here, peer -> local in stream_down_thread
+DWORD WINAPI stream_thread(LPVOID param) {
+    connection_t* conn = (connection_t*)param;
+    char buffer[BUFFER_SIZE];
+    SOCKET local;
+    unsigned long long* counter;
+    fd_set readfds;
+    struct timeval timeout;
+    unsigned long long stage_start;
+
+    conn->capture = 0;
+    conn->record = 0;
+
+    if (peer_mode == PEER_EXIT) {
+        // The exit side delivers the stream to the real service
+        int error;
+        conn->backend = backend_pick(&conn->client_addr);
+        conn->remote_socket = upstream_connect(&conn->backend, &conn->client_addr, &error);
+        if (conn->remote_socket == INVALID_SOCKET) {
+            close_set(conn, CLOSE_REASON(CLOSE_SIDE_REMOTE, CLOSE_OP_SETUP, close_kind(error)), error > 0 ? error : 0);
+            goto cleanup_stream;
+        }
+        conn->ttfb_from_us = backend_count > 1 ? now_us() : 0;
+        local = conn->remote_socket;
+        counter = &conn->bytes_remote_to_client;
+    }
+    else {
+        local = conn->client_socket;
+        counter = &conn->bytes_client_to_remote;
+    }
+
+    if (peer_mode == PEER_ENTRY) {
+        configure_socket(local, LEG_CLIENT, SOCKOPT_ALL & ~listener_inherited);
+    }
+    else {
+        configure_socket(local, LEG_REMOTE, SOCKOPT_ALL & ~SOCKOPT_BLOCKING);
+    }
+    tap_open(conn, local);
+
+    conn->down_handle = CreateThread(NULL, 0, stream_down_thread, conn, 0, NULL);
+    if (conn->down_handle == NULL) {
+        fprintf(stderr, "[ERROR] CreateThread() failed: %lu\n", GetLastError());
+        goto cleanup_stream;
+    }
+
+    printf("[INFO] Stream %u established%s, forwarding traffic...\n",
+        conn->stream_id, conn->striped ? " (striped)" : "");
+
+    while (running && conn->active && !conn->kill_requested && !conn->closing && !conn->peer_closed) {
+        FD_ZERO(&readfds);
+        FD_SET(local, &readfds);
+        timeout.tv_sec = 1;
+        timeout.tv_usec = 0;
+
+        int result = select((int)local + 1, &readfds, NULL, NULL, &timeout);
+        if (result == SOCKET_ERROR) {
+            print_error("select() failed");
+            close_set(conn, CLOSE_ERROR, WSAGetLastError());
+            break;
+        }
+        if (result == 0) {
+            if (idle_timeout > 0 && GetTickCount64() - conn->last_activity >= (ULONGLONG)idle_timeout * 1000) {
+                close_set(conn, CLOSE_IDLE, 0);
+                break;
+            }
+            continue;
+        }
+
+        stage_start = profile_begin();
+        int bytes_received = recv(local, buffer, BUFFER_SIZE, 0);
+        if (bytes_received <= 0) {
+            close_as(conn, peer_mode == PEER_ENTRY ? CLOSE_SIDE_CLIENT : CLOSE_SIDE_REMOTE,
+                CLOSE_OP_RECV, bytes_received == 0 ? 0 : WSAGetLastError());
+            break;
+        }
+
+        if (mux_send_data(conn, buffer, bytes_received) != 0) {
+            // The tunnel link is gone or the stream was torn down under us
+            close_set(conn, CLOSE_REASON(CLOSE_SIDE_PEER, CLOSE_OP_SEND, CLOSE_ABORTED), 0);
+            break;
+        }
+        if (*counter == 0) {
+            trace_first_byte(conn, peer_mode == PEER_ENTRY ? "client" : "remote", bytes_received);
+            backend_first_byte(conn);
+        }
+        *counter += bytes_received;
+        conn->last_activity = GetTickCount64();
+
+        // Only the entry side sees client->remote traffic on its local socket
+        if (peer_mode == PEER_ENTRY) {
+            mirror_enqueue(conn, MIRROR_DATA, buffer, bytes_received);
+        }
+        profile_end(STAGE_RELAY, stage_start);
+        stage_start = profile_begin();
+        tap_event(conn, RELAY_IN, buffer, bytes_received);
+        profile_end(STAGE_LOG, stage_start);
+        rate_limit_wait(conn, 0, bytes_received);
+    }
+
+cleanup_stream:
+    if (peer_mode == PEER_ENTRY) {
+        mirror_enqueue(conn, MIRROR_CLOSE, NULL, 0);
+    }
+    tap_event(conn, RELAY_CLOSE, NULL, 0);
+    conn->closing = 1;
+    if (!conn->peer_closed) {
+        // Carry the final sequence number so a striped peer can wait for stragglers
+        mux_send_frame(conn->link, conn->stream_id, MUX_CLOSE, 0, conn->tx_seq, NULL, 0);
+    }
+
+    // Let the down thread flush whatever the peer already sent
+    SetEvent(conn->rx_event);
+    if (conn->down_handle != NULL) {
+        WaitForSingleObject(conn->down_handle, INFINITE);
+        CloseHandle(conn->down_handle);
+        conn->down_handle = NULL;
+    }
+
+    if (conn->peer_closed) {
+        // The far side of the tunnel ended it; the peer forwarder relayed an orderly close
+        close_set(conn, CLOSE_REASON(peer_mode == PEER_ENTRY ? CLOSE_SIDE_REMOTE : CLOSE_SIDE_CLIENT,
+            CLOSE_OP_RECV, CLOSE_EOF), 0);
+    }
+    close_finish(conn);
+    trace_close(conn);
+    stage_start = profile_begin();
+    if (access_log_path != NULL) {
+        access_log_close(conn);
+    }
+    else {
+        char reason[48];
+        format_close_reason(reason, sizeof(reason), conn->close_reason);
+        printf("[INFO] Closing stream %u: %s (Sent: %llu bytes, Received: %llu bytes, Total: %llu bytes)\n",
+            conn->stream_id, reason, conn->bytes_client_to_remote, conn->bytes_remote_to_client,
+            conn->bytes_client_to_remote + conn->bytes_remote_to_client);
+    }
+    profile_end(STAGE_LOG, stage_start);
+    profile_flush();
+
+    if (conn->client_socket != INVALID_SOCKET) {
+        shutdown(conn->client_socket, SD_BOTH);
+        closesocket(conn->client_socket);
+    }
+    if (conn->remote_socket != INVALID_SOCKET) {
+        shutdown(conn->remote_socket, SD_BOTH);
+        closesocket(conn->remote_socket);
+        backend_done(conn->backend);
+    }
+
+    mux_release_stream(conn);
+    return 0;
+}
+
+// Exit side: start a stream the entry side opened
+void mux_accept_stream(mux_link_t* link, unsigned int stream_id, int flags) {
+    int conn_index = mux_alloc_stream(link, stream_id, flags, INVALID_SOCKET, NULL);
+    if (conn_index == -1) {
+        mux_send_frame(link, stream_id, MUX_CLOSE, 0, 0, NULL, 0);
+        return;
+    }
+
+    connections[conn_index].thread_handle = CreateThread(
+        NULL, 0, stream_thread, &connections[conn_index], 0, NULL);
+
+    if (connections[conn_index].thread_handle == NULL) {
+        fprintf(stderr, "[ERROR] CreateThread() failed: %lu\n", GetLastError());
+        mux_release_stream(&connections[conn_index]);
+        mux_send_frame(link, stream_id, MUX_CLOSE, 0, 0, NULL, 0);
+    }
+}
+
+// Mark a link dead and close every stream that depended on it: its own
+// streams, and every striped stream of the session (their data may be lost)
+void mux_link_down(mux_link_t* link) {
+    link->up = 0;
+    shutdown(link->socket, SD_BOTH);
+
+    EnterCriticalSection(&link->send_lock);
+    closesocket(link->socket);
+    link->socket = INVALID_SOCKET;
+    LeaveCriticalSection(&link->send_lock);
+
+    for (int i = 0; i < MAX_CONNECTIONS; i++) {
+        connection_t* conn = &connections[i];
+        if (conn->link == NULL || conn->session_id != link->session_id) {
+            continue;
+        }
+        EnterCriticalSection(&conn->stream_lock);
+        if (conn->link == link || (conn->link != NULL && conn->striped &&
+            conn->session_id == link->session_id)) {
+            conn->peer_closed = 1;
+            SetEvent(conn->rx_event);
+            SetEvent(conn->tx_event);
+        }
+        LeaveCriticalSection(&conn->stream_lock);
+    }
+}
+
+// Read frames from a link and dispatch them to their streams
+DWORD WINAPI mux_reader_thread(LPVOID param) {
+    mux_link_t* link = (mux_link_t*)param;
+    unsigned char header[MUX_FRAME_HEADER];
+    char payload[MUX_MAX_PAYLOAD];
+    char unpacked[MUX_MAX_PAYLOAD];
+    int hello_seen = peer_mode == PEER_ENTRY;  // Only the exit side expects a HELLO
+
+    while (running) {
+        if (recv_exact(link->socket, (char*)header, MUX_FRAME_HEADER) != 0) {
+            break;
+        }
+
+        unsigned int stream_id = get_be32(header);
+        int type = header[4];
+        int flags = header[5];
+        int len = (header[6] << 8) | header[7];
+        unsigned int seq = get_be32(header + 8);
+
+        if (len > MUX_MAX_PAYLOAD) {
+            fprintf(stderr, "[ERROR] Peer frame too large (%d bytes)\n", len);
+            break;
+        }
+        if (len > 0 && recv_exact(link->socket, payload, len) != 0) {
+            break;
+        }
+
+        if (!hello_seen) {
+            // HELLO: magic, session id (two words), per-stream window
+            const unsigned char* p = (const unsigned char*)payload;
+            if (type != MUX_HELLO || len < 16 || get_be32(p) != MUX_MAGIC) {
+                fprintf(stderr, "[ERROR] Peer link did not start with a valid HELLO\n");
+                break;
+            }
+            int window = (int)get_be32(p + 12);
+            if (window < MUX_MAX_PAYLOAD || window > MUX_MAX_WINDOW) {
+                fprintf(stderr, "[ERROR] Peer requested an invalid window (%d bytes)\n", window);
+                break;
+            }
+            link->session_id = ((ULONGLONG)get_be32(p + 4) << 32) | get_be32(p + 8);
+            link->window = window;
+            hello_seen = 1;
+            continue;
+        }
+
+        if (type == MUX_OPEN) {
+            if (peer_mode == PEER_EXIT) {
+                mux_accept_stream(link, stream_id, flags);
+            }
+            continue;
+        }
+
+        // Decompress before taking the stream lock
+        char* data = payload;
+        if (type == MUX_DATA && (flags & MUX_F_LZ4)) {
+            len = lz4_decompress((const unsigned char*)payload, len, (unsigned char*)unpacked, MUX_MAX_PAYLOAD);
+            if (len < 0) {
+                fprintf(stderr, "[ERROR] Corrupt LZ4 block on stream %u\n", stream_id);
+                break;
+            }
+            data = unpacked;
+        }
+
+        connection_t* conn = mux_lock_stream(link->session_id, stream_id);
+        if (conn == NULL) {
+            continue;  // Stream already closed on this side
+        }
+        conn->peer_known = 1;  // Any frame from the peer means it processed our OPEN
+
+        switch (type) {
+        case MUX_DATA:
+            if (mux_deliver_data(conn, seq, data, len) != 0) {
+                conn->peer_closed = 1;
+                SetEvent(conn->tx_event);
+            }
+            break;
+        case MUX_WINDOW_UPDATE:
+            if (len == 4) {
+                conn->send_window += (int)get_be32((const unsigned char*)payload);
+                SetEvent(conn->tx_event);
+            }
+            break;
+        case MUX_CLOSE:
+            // On a striped stream, DATA still in flight on other links may trail the CLOSE
+            if (conn->rx_seq == seq) {
+                conn->peer_closed = 1;
+                SetEvent(conn->tx_event);
+            }
+            else {
+                conn->close_pending = 1;
+                conn->close_seq = seq;
+            }
+            break;
+        }
+        SetEvent(conn->rx_event);
+        LeaveCriticalSection(&conn->stream_lock);
+    }
+
+    if (running) {
+        printf("[INFO] Peer link %d down\n", (int)(link - mux_links));
+    }
+    mux_link_down(link);
+
+    // Exit side: keep the slot reserved until its streams are gone, so a
+    // reconnecting peer can't collide with stream IDs still draining here
+    if (peer_mode == PEER_EXIT) {
+        while (link->streams > 0) {
+            Sleep(100);
+        }
+        link->in_use = 0;
+    }
+    return 0;
+}
+
+// Start reading frames on a freshly connected link
+int mux_start_link(mux_link_t* link, SOCKET s) {
+    configure_socket(s, LEG_PEER, SOCKOPT_ALL);
+
+    // Idle links are normal; rely on keepalive instead of a receive timeout
+    int no_timeout = 0;
+    setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, (char*)&no_timeout, sizeof(no_timeout));
+
+    if (link->reader_handle != NULL) {
+        CloseHandle(link->reader_handle);
+        link->reader_handle = NULL;
+    }
+
+    link->socket = s;
+    link->up = 1;
+    link->reader_handle = CreateThread(NULL, 0, mux_reader_thread, link, 0, NULL);
+    if (link->reader_handle == NULL) {
+        fprintf(stderr, "[ERROR] CreateThread() failed: %lu\n", GetLastError());
+        link->up = 0;
+        link->socket = INVALID_SOCKET;
+        closesocket(s);
+        return -1;
+    }
+    return 0;
+}
+
+// Entry side: (re)connect a link to the exit forwarder
+int mux_connect_link(mux_link_t* link, const char* host, int port) {
+    // A previous reader may still be tearing the link down
+    if (link->reader_handle != NULL && WaitForSingleObject(link->reader_handle, 0) != WAIT_OBJECT_0) {
+        return -1;
+    }
+
+    link->last_attempt = GetTickCount64();
+    SOCKET s = connect_remote(host, port, 0);
+    if (s == INVALID_SOCKET) {
+        return -1;
+    }
+
+    link->session_id = mux_session_id;
+    link->window = mux_window;
+    if (mux_start_link(link, s) != 0) {
+        return -1;
+    }
+
+    unsigned char hello[16];
+    put_be32(hello, MUX_MAGIC);
+    put_be32(hello + 4, (unsigned int)(mux_session_id >> 32));
+    put_be32(hello + 8, (unsigned int)mux_session_id);
+    put_be32(hello + 12, (unsigned int)mux_window);
+    if (mux_send_frame(link, 0, MUX_HELLO, 0, 0, (const char*)hello, sizeof(hello)) != 0) {
+        return -1;
+    }
+
+    printf("[INFO] Peer link %d connected to %s:%d\n", (int)(link - mux_links), host, port);
+    return 0;
+}
+
+// Entry side: redial dead links every MUX_RETRY_MS. Runs on its own thread so
+// a peer that is down never holds up the accept loop in connect().
+DWORD WINAPI mux_redial_thread(LPVOID param) {
+    (void)param;
+
+    while (running) {
+        Sleep(1000);
+        ULONGLONG now = GetTickCount64();
+        for (int i = 0; i < peer_link_count && running; i++) {
+            mux_link_t* link = &mux_links[i];
+            if (!link->up && now - link->last_attempt >= MUX_RETRY_MS) {
+                mux_connect_link(link, backends[0].host, backends[0].port);
+            }
+        }
+    }
+    return 0;
+}
+
+// Entry side: choose the least-loaded live link
+mux_link_t* mux_pick_link() {
+    mux_link_t* best = NULL;
+
+    for (int i = 0; i < peer_link_count; i++) {
+        mux_link_t* link = &mux_links[i];
+        if (link->up && (best == NULL || link->streams < best->streams)) {
+            best = link;
+        }
+    }
+    return best;
+}
+
+// Entry side: open a new stream for an accepted client
+int mux_open_stream(SOCKET client_socket, const struct sockaddr_storage* client_addr,
+    const char* remote_host, int remote_port) {
+    mux_link_t* link = mux_pick_link();
+    if (link == NULL) {
+        fprintf(stderr, "[ERROR] No link to peer %s:%d available\n", remote_host, remote_port);
+        closesocket(client_socket);
+        return -1;
+    }
+
+    unsigned int stream_id = (unsigned int)InterlockedIncrement(&mux_next_stream_id);
+    int open_flags = (peer_stripe ? MUX_F_STRIPED : 0) | (peer_compress ? MUX_F_COMPRESS : 0);
+    int conn_index = mux_alloc_stream(link, stream_id, open_flags, client_socket, client_addr);
+    if (conn_index == -1) {
+        closesocket(client_socket);
+        return -1;
+    }
+
+    // Register the stream before OPEN so an immediate reply finds it
+    if (mux_send_frame(link, stream_id, MUX_OPEN, open_flags, 0, NULL, 0) != 0) {
+        fprintf(stderr, "[ERROR] Failed to open stream %u on peer link\n", stream_id);
+        mux_release_stream(&connections[conn_index]);
+        closesocket(client_socket);
+        return -1;
+    }
+
+    connections[conn_index].thread_handle = CreateThread(
+        NULL, 0, stream_thread, &connections[conn_index], 0, NULL);
+
+    if (connections[conn_index].thread_handle == NULL) {
+        fprintf(stderr, "[ERROR] CreateThread() failed: %lu\n", GetLastError());
+        mux_send_frame(link, stream_id, MUX_CLOSE, 0, 0, NULL, 0);
+        mux_release_stream(&connections[conn_index]);
+        closesocket(client_socket);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Exit side: adopt an accepted connection as a link from the entry forwarder
+int mux_accept_link(SOCKET s) {
+    mux_link_t* link = NULL;
+
+    for (int i = 0; i < MUX_MAX_LINKS; i++) {
+        if (!mux_links[i].in_use) {
+            link = &mux_links[i];
+            break;
+        }
+    }
+
+    if (link == NULL) {
+        fprintf(stderr, "[ERROR] Maximum peer links reached\n");
+        closesocket(s);
+        return -1;
+    }
+
+    // Remember the link's address so it isn't mistaken for a queued client
+    int addr_len = sizeof(link->peer_addr);
+    ZeroMemory(&link->peer_addr, sizeof(link->peer_addr));
+    getpeername(s, (struct sockaddr*)&link->peer_addr, &addr_len);
+    addr_unmap(&link->peer_addr);
+
+    // Session and window arrive in HELLO; nothing can be looked up before then
+    link->in_use = 1;
+    link->session_id = 0;
+    link->window = MUX_DEFAULT_WINDOW;
+    if (mux_start_link(link, s) != 0) {
+        link->in_use = 0;
+        return -1;
+    }
+    return 0;
+}
+
+// Handle new client connection
+int handle_connection(SOCKET client_socket, const struct sockaddr_storage* client_addr,
+    const char* remote_host, int remote_port) {
+    int conn_index = -1;
+
+    // Entry side of a peer tunnel: no upstream connect, just a new stream
+    if (peer_mode == PEER_ENTRY) {
+        return mux_open_stream(client_socket, client_addr, remote_host, remote_port);
+    }
+
+    // Take the slot (and TLS state) first: if there is no room, the backend
+    // never sees a connect for a client we would have to drop anyway
+    conn_index = alloc_connection(client_socket, INVALID_SOCKET, client_addr);
+    if (conn_index == -1) {
+        closesocket(client_socket);
+        return -1;
+    }
+
+    if (tls_enabled) {
+        connections[conn_index].tls = tls_session_create();
+        if (connections[conn_index].tls == NULL) {
+            fprintf(stderr, "[ERROR] Out of memory for TLS session\n");
+            EnterCriticalSection(&conn_lock);
+            connections[conn_index].active = 0;
+            LeaveCriticalSection(&conn_lock);
+            closesocket(client_socket);
+            return -1;
+        }
+    }
+
+    // Create forwarding thread; it makes the upstream connect itself
+    connections[conn_index].thread_handle = CreateThread(
+        NULL, 0, forward_thread, &connections[conn_index], 0, NULL);
+
+    if (connections[conn_index].thread_handle == NULL) {
+        fprintf(stderr, "[ERROR] CreateThread() failed: %lu\n", GetLastError());
+        if (connections[conn_index].tls != NULL) {
+            tls_release_cred(connections[conn_index].tls->cred);
+            free(connections[conn_index].tls);
+            connections[conn_index].tls = NULL;
+        }
+        EnterCriticalSection(&conn_lock);
+        connections[conn_index].active = 0;
+        LeaveCriticalSection(&conn_lock);
+        closesocket(client_socket);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Estimated memory one more connection commits: stack and relay buffer, TLS
+// record buffers, and the receive ring of a tunnel stream
+long long conn_memory_estimate() {
+    long long bytes = CONN_MEMORY_BASE;
+    if (tls_cert_subject != NULL) {
+        bytes += 3 * TLS_BUFFER_SIZE;
+    }
+    if (peer_mode != PEER_NONE) {
+        bytes += mux_window;
+    }
+    return bytes;
+}
+
+// Admission control, run before any upstream work: returns NULL to admit the
+// client, or why it is shed. Newcomers are turned away rather than disturbing
+// established connections; the last priority_reserve connections' worth of
+// every limit is kept for priority sources.
+const char* admit_client(const struct sockaddr_storage* client_addr) {
+    int active = 0;
+    int sockets = 0;
+
+    for (int i = 0; i < MAX_CONNECTIONS; i++) {
+        if (connections[i].active) {
+            active++;
+            // A relayed connection still connecting upstream will need its remote socket
+            sockets += (connections[i].client_socket != INVALID_SOCKET) +
+                (connections[i].remote_socket != INVALID_SOCKET || peer_mode == PEER_NONE);
+        }
+    }
+
+    int reserve = is_priority_ip(client_addr) ? 0 : priority_reserve;
+    if (active + 1 > admit_limit - reserve) {
+        return active + 1 > admit_limit ? "connection limit" : "reserved for priority sources";
+    }
+    if (memory_budget > 0 && (long long)(active + 1 + reserve) * conn_memory_estimate() > memory_budget) {
+        return "memory budget";
+    }
+    if (socket_budget > 0 && sockets + 2 * (1 + reserve) > socket_budget) {
+        return "socket budget";
+    }
+    return NULL;
+}
+
+// Turn a client away as cheaply as possible: an abortive close frees the
+// socket at once instead of lingering in TIME_WAIT
+void shed_client(SOCKET s) {
+    struct linger abort_close;
+    abort_close.l_onoff = 1;
+    abort_close.l_linger = 0;
+    setsockopt(s, SOL_SOCKET, SO_LINGER, (char*)&abort_close, sizeof(abort_close));
+    closesocket(s);
+}
+
+// Filter, log and hand off one accepted client
+void accept_client(SOCKET client_socket, struct sockaddr_storage* client_addr, const char* remote_host, int remote_port) {
+    unsigned long long stage_start = profile_begin();
+    char client[ADDR_TEXT_LEN];  // Only formatted for lines that are printed
+
+    // Check if IP is allowed
+    if (!is_ip_allowed(client_addr)) {
+        if (verbose_mode) {
+            format_addr(client, sizeof(client), client_addr);
+            printf("[INFO] Connection from %s REJECTED (IP not allowed)\n", client);
+        }
+        closesocket(client_socket);
+        trace_accept(client_addr, "not allowed");
+        profile_end(STAGE_ACCEPT, stage_start);
+        return;
+    }
+
+    if (draining) {
+        format_addr(client, sizeof(client), client_addr);
+        printf("[INFO] Connection from %s REJECTED (draining)\n", client);
+        closesocket(client_socket);
+        trace_accept(client_addr, "draining");
+        profile_end(STAGE_ACCEPT, stage_start);
+        return;
+    }
+
+    // Overloaded: shed before logging, resolving or connecting anything.
+    // On the exit side these are peer links; their streams are admitted per slot.
+    const char* shed = peer_mode != PEER_EXIT ? admit_client(client_addr) : NULL;
+    if (shed != NULL) {
+        InterlockedIncrement64(&stat_shed);
+        if (verbose_mode) {
+            format_addr(client, sizeof(client), client_addr);
+            printf("[INFO] Connection from %s REJECTED (%s)\n", client, shed);
+        }
+        shed_client(client_socket);
+        trace_accept(client_addr, "shed");
+        profile_end(STAGE_ACCEPT, stage_start);
+        return;
+    }
+
+    trace_accept(client_addr, "accepted");
+    profile_end(STAGE_ACCEPT, stage_start);
+    // The access log records the address in binary, and --top discards stdout
+    if (access_log_path == NULL && !top_mode) {
+        stage_start = profile_begin();
+        format_addr(client, sizeof(client), client_addr);
+        printf("[INFO] New connection from %s ACCEPTED\n", client);
+        profile_end(STAGE_LOG, stage_start);
+    }
+
+    // Handle connection in new thread. Until it has a slot, the queue
+    // sampler would otherwise count it as still waiting in the backlog.
+    accept_current = *client_addr;
+    accept_busy = 1;
+    if (peer_mode == PEER_EXIT) {
+        mux_accept_link(client_socket);
+    }
+    else {
+        handle_connection(client_socket, client_addr, remote_host, remote_port);
+    }
+    accept_busy = 0;
+}
+
+// Control socket client connection
+typedef struct {
+    SOCKET socket;
+    char line[512];
+    int len;
+    int overflow;   // Discarding the rest of a line that didn't fit
+} control_client_t;
+
+// Append formatted text to a control reply
+void control_reply(SOCKET s, const char* fmt, ...) {
+    char buf[4096];
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+    if (n > 0) {
+        send_all(s, buf, n < (int)sizeof(buf) ? n : (int)sizeof(buf) - 1);
+    }
+}
+
+// Run one control command and send its reply, ending with "OK" or "ERR <reason>"
+void control_command(SOCKET s, char* line) {
+    char* context = NULL;
+    char* cmd = strtok_s(line, " \t\r\n", &context);
+    char* arg1 = strtok_s(NULL, " \t\r\n", &context);
+    char* arg2 = strtok_s(NULL, " \t\r\n", &context);
+    ULONGLONG now = GetTickCount64();
+
+    if (cmd == NULL) {
+        return;
+    }
+
+    if (strcmp(cmd, "list") == 0) {
+        for (int i = 0; i < MAX_CONNECTIONS; i++) {
+            connection_t* conn = &connections[i];
+            if (!conn->active || conn->id == 0) {
+                continue;
+            }
+            char source[ADDR_TEXT_LEN];
+            if (conn->client_addr.ss_family != 0) {
+                format_addr(source, sizeof(source), &conn->client_addr);
+            }
+            else {
+                snprintf(source, sizeof(source), "peer-stream-%u", conn->stream_id);
+            }
+            // Relay threads keep updating these, possibly past the now sampled above
+            ULONGLONG started = conn->started;
+            ULONGLONG last = conn->last_activity;
+            control_reply(s, "%llu %s %s age=%llus idle=%llus in=%llu out=%llu limit=%ld\n",
+                conn->id, source, conn->backend != NULL ? conn->backend->label : "-",
+                (now > started ? now - started : 0) / 1000, (now > last ? now - last : 0) / 1000,
+                conn->bytes_client_to_remote, conn->bytes_remote_to_client, (long)conn->rate_limit / 1024);
+        }
+        control_reply(s, "OK\n");
+    }
+    else if (strcmp(cmd, "kill") == 0 && arg1 != NULL) {
+        unsigned long long id = _strtoui64(arg1, NULL, 10);
+        int found = 0;
+        // conn_lock only guards slot reuse; the relay thread sees the flag within a second
+        EnterCriticalSection(&conn_lock);
+        for (int i = 0; i < MAX_CONNECTIONS; i++) {
+            if (connections[i].active && connections[i].id == id) {
+                connections[i].kill_requested = 1;
+                found = 1;
+                break;
+            }
+        }
+        LeaveCriticalSection(&conn_lock);
+        control_reply(s, found ? "OK\n" : "ERR no such connection\n");
+    }
+    else if (strcmp(cmd, "drain") == 0) {
+        if (arg1 != NULL && strcmp(arg1, "off") == 0) {
+            draining = 0;
+        }
+        else {
+            draining = 1;
+        }
+        int active = 0;
+        for (int i = 0; i < MAX_CONNECTIONS; i++) {
+            if (connections[i].active) {
+                active++;
+            }
+        }
+        control_reply(s, "draining=%d active=%d\nOK\n", draining, active);
+    }
+    else if (strcmp(cmd, "ratelimit") == 0 && arg1 != NULL && arg2 != NULL) {
+        LONG limit;
+        if (parse_rate_limit(arg2, &limit) != 0) {
+            control_reply(s, "ERR rate must be 0-%ld KB/s\n", (long)(MAXLONG / 1024));
+            return;
+        }
+        if (strcmp(arg1, "default") == 0) {
+            default_rate_limit = limit;
+        }
+        else {
+            int all = strcmp(arg1, "all") == 0;
+            unsigned long long id = all ? 0 : _strtoui64(arg1, NULL, 10);
+            int found = 0;
+            for (int i = 0; i < MAX_CONNECTIONS; i++) {
+                if (connections[i].active && (all || connections[i].id == id)) {
+                    InterlockedExchange(&connections[i].rate_limit, limit);
+                    found = 1;
+                }
+            }
+            if (!found && !all) {
+                control_reply(s, "ERR no such connection\n");
+                return;
+            }
+        }
+        control_reply(s, "OK\n");
+    }
+    else if (strcmp(cmd, "backends") == 0) {
+        for (int i = 0; i < backend_count; i++) {
+            backend_t* b = &backends[i];
+            control_reply(s, "%d %s %s breaker=%s weight=%.2f active=%ld picks=%lld connect_ms=%.1f ttfb_ms=%.1f\n",
+                i, b->label, b->down ? "down" : "up", breaker_state_names[b->state], backend_ramp(b, now),
+                (long)b->active, (LONG64)b->picks, b->ewma_connect_us / 1000.0, b->ewma_ttfb_us / 1000.0);
+        }
+        control_reply(s, "OK\n");
+    }
+    else if (strcmp(cmd, "backend") == 0 && arg1 != NULL && arg2 != NULL) {
+        int index;
+        if (parse_int(arg1, 0, backend_count - 1, &index) != 0 || peer_mode == PEER_ENTRY) {
+            control_reply(s, "ERR no such backend\n");
+            return;
+        }
+        backend_t* b = &backends[index];
+        if (strcmp(arg2, "down") == 0) {
+            // Existing connections finish normally; only new ones go elsewhere
+            b->down = 1;
+        }
+        else if (strcmp(arg2, "up") == 0) {
+            if (b->down) {
+                backend_warm_up(b);
+                b->down = 0;
+            }
+        }
+        else {
+            control_reply(s, "ERR expected up or down\n");
+            return;
+        }
+        printf("[INFO] Backend %s taken %s by the control socket\n", b->label, b->down ? "down" : "up");
+        control_reply(s, "OK\n");
+    }
+    else if (strcmp(cmd, "stats") == 0) {
+        char line_buf[STATS_LINE_SIZE];
+        int n = format_stats(line_buf, sizeof(line_buf));
+        send_all(s, line_buf, n);  // Longer than control_reply()'s buffer with many backends
+        control_reply(s, "\nOK\n");
+    }
+    else if (strcmp(cmd, "help") == 0) {
+        control_reply(s, "list | kill <id> | drain [off] | ratelimit <id|all|default> <KB/s> | backends | backend <n> <up|down> | stats\nOK\n");
+    }
+    else {
+        control_reply(s, "ERR unknown command (try help)\n");
+    }
+}
+
+// Serve the control socket: one select() loop over the listener and its clients
+DWORD WINAPI control_thread(LPVOID param) {
+    control_client_t clients[CONTROL_MAX_CLIENTS];
+    (void)param;
+
+    for (int i = 0; i < CONTROL_MAX_CLIENTS; i++) {
+        clients[i].socket = INVALID_SOCKET;
+    }
+
+    while (running) {
+        fd_set readfds;
+        struct timeval timeout;
+
+        FD_ZERO(&readfds);
+        FD_SET(control_socket, &readfds);
+        for (int i = 0; i < CONTROL_MAX_CLIENTS; i++) {
+            if (clients[i].socket != INVALID_SOCKET) {
+                FD_SET(clients[i].socket, &readfds);
+            }
+        }
+        timeout.tv_sec = 1;
+        timeout.tv_usec = 0;
+
+        int result = select(0, &readfds, NULL, NULL, &timeout);
+        if (result == SOCKET_ERROR) {
+            break;
+        }
+        if (result == 0) {
+            continue;
+        }
+
+        if (FD_ISSET(control_socket, &readfds)) {
+            SOCKET s = accept(control_socket, NULL, NULL);
+            if (s != INVALID_SOCKET) {
+                int slot = -1;
+                for (int i = 0; i < CONTROL_MAX_CLIENTS; i++) {
+                    if (clients[i].socket == INVALID_SOCKET) {
+                        slot = i;
+                        break;
+                    }
+                }
+                if (slot == -1) {
+                    control_reply(s, "ERR too many control clients\n");
+                    closesocket(s);
+                }
+                else {
+                    // A client that stops reading must not stall the loop
+                    int timeout_ms = 1000;
+                    setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, (char*)&timeout_ms, sizeof(timeout_ms));
+                    clients[slot].socket = s;
+                    clients[slot].len = 0;
+                    clients[slot].overflow = 0;
+                }
+            }
+        }
+
+        for (int i = 0; i < CONTROL_MAX_CLIENTS; i++) {
+            control_client_t* client = &clients[i];
+            if (client->socket == INVALID_SOCKET || !FD_ISSET(client->socket, &readfds)) {
+                continue;
+            }
+
+            int n = recv(client->socket, client->line + client->len,
+                (int)sizeof(client->line) - 1 - client->len, 0);
+            if (n <= 0) {
+                closesocket(client->socket);
+                client->socket = INVALID_SOCKET;
+                continue;
+            }
+            client->len += n;
+            client->line[client->len] = '\0';
+
+            // Run every complete line; keep a partial one for the next read
+            char* start = client->line;
+            char* newline;
+            while ((newline = strchr(start, '\n')) != NULL) {
+                *newline = '\0';
+                if (client->overflow) {
+                    client->overflow = 0;  // Tail of the overlong line; it was already refused
+                }
+                else {
+                    control_command(client->socket, start);
+                }
+                start = newline + 1;
+            }
+            client->len -= (int)(start - client->line);
+            memmove(client->line, start, client->len);
+            if (client->len == (int)sizeof(client->line) - 1) {
+                if (!client->overflow) {
+                    control_reply(client->socket, "ERR line too long\n");
+                }
+                client->overflow = 1;
+                client->len = 0;
+            }
+        }
+    }
+
+    for (int i = 0; i < CONTROL_MAX_CLIENTS; i++) {
+        if (clients[i].socket != INVALID_SOCKET) {
+            closesocket(clients[i].socket);
+        }
+    }
+    return 0;
+}
+
+// Create the control socket at path, replacing a stale one from a previous run
+int control_init(const char* path) {
+    struct sockaddr_un addr;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "[ERROR] Control socket path too long\n");
+        return -1;
+    }
+    ZeroMemory(&addr, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy_s(addr.sun_path, sizeof(addr.sun_path), path);
+    DeleteFileA(path);
+
+    control_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (control_socket == INVALID_SOCKET ||
+        bind(control_socket, (struct sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR ||
+        listen(control_socket, CONTROL_MAX_CLIENTS) == SOCKET_ERROR) {
+        print_error("Control socket setup failed");
+        if (control_socket != INVALID_SOCKET) {
+            closesocket(control_socket);
+            control_socket = INVALID_SOCKET;
+        }
+        return -1;
+    }
+    return 0;
+}
+
+// Client side: send one command to a running forwarder's control socket and print the reply
+int control_client(const char* path, int argc, char* argv[]) {
+    WSADATA wsa_data;
+    struct sockaddr_un addr;
+    char command[512];
+    char reply[4096];
+    int len = 0;
+    int n;
+
+    // Same limit as the server's line buffer; strcat_s would abort on overflow
+    for (int i = 0; i < argc; i++) {
+        n = snprintf(command + len, sizeof(command) - len, "%s%s", argv[i], i + 1 < argc ? " " : "\n");
+        if (n < 0 || n >= (int)sizeof(command) - len) {
+            fprintf(stderr, "[ERROR] Control command line too long (max %d characters)\n", (int)sizeof(command) - 2);
+            return 1;
+        }
+        len += n;
+    }
+
+    if (WSAStartup(MAKEWORD(2, 2), &wsa_data) != 0) {
+        fprintf(stderr, "[ERROR] WSAStartup() failed\n");
+        return 1;
+    }
+    ZeroMemory(&addr, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy_s(addr.sun_path, sizeof(addr.sun_path), path, _TRUNCATE);
+
+    SOCKET s = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (s == INVALID_SOCKET || connect(s, (struct sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR) {
+        print_error("Cannot reach control socket");
+        WSACleanup();
+        return 1;
+    }
+    send_all(s, command, len);
+    shutdown(s, SD_SEND);
+    while ((n = recv(s, reply, sizeof(reply), 0)) > 0) {
+        fwrite(reply, 1, n, stdout);
+    }
+    closesocket(s);
+    WSACleanup();
+    return 0;
+}
+
+// One recorded relay event of a replayed connection
+typedef struct {
+    int type;
+    LONG64 time_us;      // Since the recording started
+    int len;
+    const char* data;    // Recorded bytes inside the loaded file; NULL without payloads
+} replay_event_t;
+
+// A recorded connection and what replaying it measured
+typedef struct {
+    unsigned long long id;
+    replay_event_t* events;
+    int count;
+    int cap;
+    HANDLE client_handle;
+    int failed;
+    LONG64 bytes;
+    double latency_ms_total;  // Last request byte sent -> full response received
+    double latency_ms_max;
+    int responses;
+} replay_conn_t;
+
+char* replay_path = NULL;       // Run as a replayer instead of a forwarder
+double replay_speed = 1.0;      // 2.0 = twice as fast as recorded, 0 = as fast as possible
+replay_conn_t* replay_conns = NULL;
+int replay_conn_count = 0;
+const char* replay_target_host = NULL;
+int replay_target_port = 0;
+LONG64 replay_time_base = 0;    // Recorded time of the first connection
+LARGE_INTEGER replay_clock_start;
+LARGE_INTEGER replay_clock_freq;
+volatile LONG replay_sinks_active = 0;
+
+// A sink listener; the slow one stands in for a lagging replica
+typedef struct {
+    SOCKET socket;
+    int port;
+    int delay_ms;              // Added before every response
+    volatile LONG connections; // Connections the forwarder sent here
+} replay_sink_t;
+
+replay_sink_t replay_sinks[2];
+int replay_sink_count = 1;
+
+// One accepted sink connection and the listener it came in on
+typedef struct {
+    SOCKET socket;
+    replay_sink_t* sink;
+} replay_sink_conn_t;
+
+// Decode a LEB128 varint; returns NULL if it runs past end
+const unsigned char* get_varint(const unsigned char* p, const unsigned char* end, unsigned long long* v) {
+    int shift = 0;
+    *v = 0;
+    while (p < end && shift < 64) {
+        *v |= (unsigned long long)(*p & 0x7F) << shift;
+        if ((*p++ & 0x80) == 0) {
+            return p;
+        }
+        shift += 7;
+    }
+    return NULL;
+}
+
+// Read a recording into replay_conns; the file buffer stays alive for the payload pointers
+int replay_load(const char* path) {
+    FILE* f;
+    unsigned char* file_buf;
+    long size;
+
+    if (fopen_s(&f, path, "rb") != 0 || f == NULL) {
+        fprintf(stderr, "[ERROR] Cannot open recording %s\n", path);
+        return -1;
+    }
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    file_buf = (unsigned char*)malloc(size > 0 ? size : 1);
+    if (file_buf == NULL || size < 24 || fread(file_buf, 1, size, f) != (size_t)size) {
+        fprintf(stderr, "[ERROR] Cannot read recording %s\n", path);
+        fclose(f);
+        free(file_buf);
+        return -1;
+    }
+    fclose(f);
+
+    unsigned int hdr[4];
+    memcpy(hdr, file_buf, sizeof(hdr));
+    if (hdr[0] != RECORD_MAGIC || hdr[1] != 1) {
+        fprintf(stderr, "[ERROR] %s is not a forwarder recording\n", path);
+        free(file_buf);
+        return -1;
+    }
+    int payloads = (hdr[2] & RECORD_F_PAYLOAD) != 0;
+
+    const unsigned char* p = file_buf + 24;
+    const unsigned char* end = file_buf + size;
+    int conn_cap = 0;
+
+    while (p < end) {
+        unsigned long long id, t, len = 0;
+        int type = *p++;
+
+        p = get_varint(p, end, &id);
+        if (p != NULL) {
+            p = get_varint(p, end, &t);
+        }
+        if (p != NULL && (type == RELAY_IN || type == RELAY_OUT)) {
+            p = get_varint(p, end, &len);
+            if (p != NULL && (len == 0 || len > BUFFER_SIZE || (payloads && (size_t)(end - p) < len))) {
+                p = NULL;
+            }
+        }
+        if (p == NULL || type > RELAY_CLOSE) {
+            fprintf(stderr, "[ERROR] Recording is truncated or corrupt; replaying what was read\n");
+            break;
+        }
+
+        // Connections are recorded in start order, so recent ones are at the end
+        replay_conn_t* conn = NULL;
+        for (int i = replay_conn_count - 1; i >= 0; i--) {
+            if (replay_conns[i].id == id) {
+                conn = &replay_conns[i];
+                break;
+            }
+        }
+        if (conn == NULL) {
+            if (type != RELAY_OPEN) {
+                if (payloads && (type == RELAY_IN || type == RELAY_OUT)) {
+                    p += len;
+                }
+                continue;  // Started before a dropped OPEN; can't be replayed
+            }
+            if (replay_conn_count == conn_cap) {
+                conn_cap = conn_cap ? conn_cap * 2 : 64;
+                replay_conn_t* grown = (replay_conn_t*)realloc(replay_conns, sizeof(replay_conn_t) * conn_cap);
+                if (grown == NULL) {
+                    fprintf(stderr, "[ERROR] Out of memory loading recording\n");
+                    return -1;
+                }
+                replay_conns = grown;
+            }
+            conn = &replay_conns[replay_conn_count++];
+            ZeroMemory(conn, sizeof(*conn));
+            conn->id = id;
+        }
+
+        if (conn->count == conn->cap) {
+            conn->cap = conn->cap ? conn->cap * 2 : 16;
+            replay_event_t* grown = (replay_event_t*)realloc(conn->events, sizeof(replay_event_t) * conn->cap);
+            if (grown == NULL) {
+                fprintf(stderr, "[ERROR] Out of memory loading recording\n");
+                return -1;
+            }
+            conn->events = grown;
+        }
+        replay_event_t* ev = &conn->events[conn->count++];
+        ev->type = type;
+        ev->time_us = (LONG64)t;
+        ev->len = (int)len;
+        ev->data = NULL;
+        if (payloads && (type == RELAY_IN || type == RELAY_OUT)) {
+            ev->data = (const char*)p;
+            p += len;
+        }
+    }
+
+    printf("[INFO] Loaded %d connections from %s (%s)\n", replay_conn_count, path,
+        payloads ? "with payloads" : "sizes only");
+    return 0;
+}
+
+// Sleep until a recorded timestamp comes due at the replay speed
+void replay_wait_until(LONG64 time_us) {
+    if (replay_speed <= 0) {
+        return;
+    }
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    double elapsed_us = (double)(now.QuadPart - replay_clock_start.QuadPart) * 1e6 / (double)replay_clock_freq.QuadPart;
+    double due_us = (double)(time_us - replay_time_base) / replay_speed;
+    if (due_us > elapsed_us + 1000) {
+        Sleep((DWORD)((due_us - elapsed_us) / 1000));
+    }
+}
+
+// Send a recorded chunk, or filler of the same size if payloads weren't recorded
+int replay_send(SOCKET s, const replay_event_t* ev) {
+    static const char filler[BUFFER_SIZE] = { 0 };
+    return send_all(s, ev->data != NULL ? ev->data : filler, ev->len) == SOCKET_ERROR ? -1 : 0;
+}
+
+// Client side of one connection: connect through the forwarder, send the
+// recorded requests on schedule and wait for each recorded response
+DWORD WINAPI replay_client_thread(LPVOID param) {
+    replay_conn_t* conn = (replay_conn_t*)param;
+    char buffer[BUFFER_SIZE];
+    LARGE_INTEGER sent_at, now;
+    int awaiting = 0;
+
+    SOCKET s = connect_remote(replay_target_host, replay_target_port, 0);
+    if (s == INVALID_SOCKET) {
+        conn->failed = 1;
+        return 0;
+    }
+    configure_socket(s, LEG_CLIENT, SOCKOPT_ALL);
+
+    // Tell the sink which recorded connection this is
+    int tag = (int)(conn - replay_conns);
+    if (send_all(s, (const char*)&tag, sizeof(tag)) == SOCKET_ERROR) {
+        conn->failed = 1;
+    }
+
+    for (int i = 0; i < conn->count && !conn->failed; i++) {
+        replay_event_t* ev = &conn->events[i];
+        if (ev->type == RELAY_IN) {
+            replay_wait_until(ev->time_us);
+            if (replay_send(s, ev) != 0) {
+                conn->failed = 1;
+                break;
+            }
+            QueryPerformanceCounter(&sent_at);
+            awaiting = 1;
+        }
+        else if (ev->type == RELAY_OUT) {
+            if (recv_exact(s, buffer, ev->len) != 0) {
+                conn->failed = 1;
+                break;
+            }
+            // Response complete once the next event isn't more of it
+            if (awaiting && (i + 1 == conn->count || conn->events[i + 1].type != RELAY_OUT)) {
+                QueryPerformanceCounter(&now);
+                double ms = (double)(now.QuadPart - sent_at.QuadPart) * 1000.0 / (double)replay_clock_freq.QuadPart;
+                conn->latency_ms_total += ms;
+                if (ms > conn->latency_ms_max) {
+                    conn->latency_ms_max = ms;
+                }
+                conn->responses++;
+                awaiting = 0;
+            }
+        }
+        else if (ev->type == RELAY_CLOSE) {
+            break;
+        }
+        if (ev->type == RELAY_IN || ev->type == RELAY_OUT) {
+            conn->bytes += ev->len;
+        }
+    }
+
+    shutdown(s, SD_SEND);
+    while (recv(s, buffer, sizeof(buffer), 0) > 0) {
+    }
+    closesocket(s);
+    return 0;
+}
+
+// Sink side of one connection: read the recorded requests and send the recorded responses on schedule
+DWORD WINAPI replay_sink_thread(LPVOID param) {
+    replay_sink_conn_t* sink_conn = (replay_sink_conn_t*)param;
+    SOCKET s = sink_conn->socket;
+    int delay_ms = sink_conn->sink->delay_ms;
+    char buffer[BUFFER_SIZE];
+    int tag;
+
+    free(sink_conn);
+
+    configure_socket(s, LEG_REMOTE, SOCKOPT_ALL);
+    if (recv_exact(s, (char*)&tag, sizeof(tag)) == 0 && tag >= 0 && tag < replay_conn_count) {
+        replay_conn_t* conn = &replay_conns[tag];
+        for (int i = 0; i < conn->count; i++) {
+            replay_event_t* ev = &conn->events[i];
+            if (ev->type == RELAY_IN) {
+                if (recv_exact(s, buffer, ev->len) != 0) {
+                    break;
+                }
+            }
+            else if (ev->type == RELAY_OUT) {
+                replay_wait_until(ev->time_us);
+                if (delay_ms > 0) {
+                    Sleep(delay_ms);
+                }
+                if (replay_send(s, ev) != 0) {
+                    break;
+                }
+            }
+            else if (ev->type == RELAY_CLOSE) {
+                break;
+            }
+        }
+    }
+
+    shutdown(s, SD_SEND);
+    while (recv(s, buffer, sizeof(buffer), 0) > 0) {
+    }
+    closesocket(s);
+    InterlockedDecrement(&replay_sinks_active);
+    return 0;
+}
+
+// Accept connections arriving at a sink from the forwarder under test
+DWORD WINAPI replay_accept_thread(LPVOID param) {
+    replay_sink_t* sink = (replay_sink_t*)param;
+
+    while (running) {
+        SOCKET s = accept(sink->socket, NULL, NULL);
+        if (s == INVALID_SOCKET) {
+            break;
+        }
+        replay_sink_conn_t* sink_conn = (replay_sink_conn_t*)malloc(sizeof(replay_sink_conn_t));
+        if (sink_conn == NULL) {
+            closesocket(s);
+            continue;
+        }
+        sink_conn->socket = s;
+        sink_conn->sink = sink;
+        InterlockedIncrement(&sink->connections);
+        InterlockedIncrement(&replay_sinks_active);
+        HANDLE h = CreateThread(NULL, 0, replay_sink_thread, sink_conn, 0, NULL);
+        if (h == NULL) {
+            InterlockedDecrement(&replay_sinks_active);
+            free(sink_conn);
+            closesocket(s);
+            continue;
+        }
+        CloseHandle(h);
+    }
+    return 0;
+}
+
+// Open a sink listener on port
+SOCKET replay_listen(int port) {
+    struct sockaddr_in sink_addr;
+
+    SOCKET sink = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    ZeroMemory(&sink_addr, sizeof(sink_addr));
+    sink_addr.sin_family = AF_INET;
+    sink_addr.sin_addr.s_addr = INADDR_ANY;
+    sink_addr.sin_port = htons((u_short)port);
+    if (sink == INVALID_SOCKET ||
+        bind(sink, (struct sockaddr*)&sink_addr, sizeof(sink_addr)) == SOCKET_ERROR ||
+        listen(sink, SOMAXCONN) == SOCKET_ERROR) {
+        print_error("Replay sink setup failed");
+        if (sink != INVALID_SOCKET) {
+            closesocket(sink);
+        }
+        return INVALID_SOCKET;
+    }
+    return sink;
+}
+
+// Replay a recording: act as the backend on sink_port and as the clients of
+// host:port, which should be a forwarder pointed back at sink_port
+int replay_run(int sink_port, const char* host, int port) {
+    WSADATA wsa_data;
+    HANDLE accept_handles[2];
+
+    if (WSAStartup(MAKEWORD(2, 2), &wsa_data) != 0) {
+        fprintf(stderr, "[ERROR] WSAStartup() failed\n");
+        return 1;
+    }
+    if (replay_load(replay_path) != 0) {
+        WSACleanup();
+        return 1;
+    }
+    if (replay_conn_count == 0) {
+        fprintf(stderr, "[ERROR] Recording has no complete connections\n");
+        WSACleanup();
+        return 1;
+    }
+    replay_time_base = replay_conns[0].events[0].time_us;
+
+    replay_sinks[0].port = sink_port;
+    for (int i = 0; i < replay_sink_count; i++) {
+        replay_sinks[i].socket = replay_listen(replay_sinks[i].port);
+        if (replay_sinks[i].socket == INVALID_SOCKET) {
+            if (i > 0) {
+                closesocket(replay_sinks[0].socket);
+            }
+            WSACleanup();
+            return 1;
+        }
+    }
+
+    replay_target_host = host;
+    replay_target_port = port;
+    for (int i = 0; i < replay_sink_count; i++) {
+        accept_handles[i] = CreateThread(NULL, 0, replay_accept_thread, &replay_sinks[i], 0, NULL);
+    }
+
+    printf("[INFO] Replaying through %s:%d into sink port %d at %s\n", host, port, sink_port,
+        replay_speed > 0 ? "recorded pace" : "full speed");
+    if (replay_speed > 0 && replay_speed != 1.0) {
+        printf("[INFO] Speed-up: %.2fx\n", replay_speed);
+    }
+    if (replay_sink_count > 1) {
+        printf("[INFO] Slow sink on port %d adds %d ms to every response\n",
+            replay_sinks[1].port, replay_sinks[1].delay_ms);
+    }
+
+    QueryPerformanceFrequency(&replay_clock_freq);
+    QueryPerformanceCounter(&replay_clock_start);
+
+    // Start each connection when it started in the recording
+    LONG64 recorded_us = 0;  // Span from the first connection's start to the last event
+    for (int i = 0; i < replay_conn_count; i++) {
+        replay_conn_t* conn = &replay_conns[i];
+        replay_wait_until(conn->events[0].time_us);
+        conn->client_handle = CreateThread(NULL, 0, replay_client_thread, conn, 0, NULL);
+        if (conn->client_handle == NULL) {
+            conn->failed = 1;
+        }
+        LONG64 last = conn->events[conn->count - 1].time_us - replay_time_base;
+        if (last > recorded_us) {
+            recorded_us = last;
+        }
+    }
+
+    LONG64 bytes = 0;
+    int failed = 0;
+    int responses = 0;
+    double latency_total = 0.0;
+    double latency_max = 0.0;
+    for (int i = 0; i < replay_conn_count; i++) {
+        replay_conn_t* conn = &replay_conns[i];
+        if (conn->client_handle != NULL) {
+            WaitForSingleObject(conn->client_handle, INFINITE);
+            CloseHandle(conn->client_handle);
+        }
+        bytes += conn->bytes;
+        failed += conn->failed;
+        responses += conn->responses;
+        latency_total += conn->latency_ms_total;
+        if (conn->latency_ms_max > latency_max) {
+            latency_max = conn->latency_ms_max;
+        }
+    }
+
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    double wall_s = (double)(now.QuadPart - replay_clock_start.QuadPart) / (double)replay_clock_freq.QuadPart;
+
+    // Give sink threads a moment to see the clients' EOF
+    for (int i = 0; i < 50 && replay_sinks_active > 0; i++) {
+        Sleep(100);
+    }
+    running = 0;
+    for (int i = 0; i < replay_sink_count; i++) {
+        closesocket(replay_sinks[i].socket);
+        if (accept_handles[i] != NULL) {
+            WaitForSingleObject(accept_handles[i], 2000);
+            CloseHandle(accept_handles[i]);
+        }
+    }
+
+    printf("[REPLAY] connections=%d failed=%d bytes=%lld recorded=%.2fs replayed=%.2fs throughput=%.1f MB/s\n",
+        replay_conn_count, failed, bytes, (double)recorded_us / 1e6, wall_s,
+        wall_s > 0 ? (double)bytes / wall_s / (1024.0 * 1024.0) : 0.0);
+    printf("[REPLAY] responses=%d latency_avg=%.3fms latency_max=%.3fms\n",
+        responses, responses > 0 ? latency_total / responses : 0.0, latency_max);
+    if (replay_sink_count > 1) {
+        // How much of the load the forwarder steered to the lagging replica
+        LONG total = replay_sinks[0].connections + replay_sinks[1].connections;
+        printf("[REPLAY] sink_connections=%ld slow_sink_connections=%ld slow_share=%.1f%%\n",
+            (long)replay_sinks[0].connections, (long)replay_sinks[1].connections,
+            total > 0 ? 100.0 * replay_sinks[1].connections / total : 0.0);
+    }
+
+    WSACleanup();
+    return failed > 0 ? 2 : 0;
+}
+
+// Cleanup function
+void cleanup() {
+    printf("\n[INFO] Shutting down...\n");
+    running = 0;
+
+    // Close listening socket
+    if (listen_socket != INVALID_SOCKET) {
+        closesocket(listen_socket);
+        listen_socket = INVALID_SOCKET;
+    }
+
+    if (control_handle != NULL) {
+        WaitForSingleObject(control_handle, 2000);
+        CloseHandle(control_handle);
+        control_handle = NULL;
+    }
+    if (control_socket != INVALID_SOCKET) {
+        closesocket(control_socket);
+        control_socket = INVALID_SOCKET;
+        DeleteFileA(control_path);
+    }
+
+    if (mux_redial_handle != NULL) {
+        WaitForSingleObject(mux_redial_handle, 2000);
+        CloseHandle(mux_redial_handle);
+        mux_redial_handle = NULL;
+    }
+
+    // Drop peer links so blocked stream threads wake up
+    if (peer_mode != PEER_NONE) {
+        for (int i = 0; i < MUX_MAX_LINKS; i++) {
+            if (mux_links[i].up) {
+                shutdown(mux_links[i].socket, SD_BOTH);
+            }
+        }
+    }
+
+    // Wait for all threads to finish
+    EnterCriticalSection(&conn_lock);
+    for (int i = 0; i < MAX_CONNECTIONS; i++) {
+        if (connections[i].active) {
+            connections[i].active = 0;
+            if (connections[i].thread_handle != NULL) {
+                LeaveCriticalSection(&conn_lock);
+                WaitForSingleObject(connections[i].thread_handle, 5000);
+                EnterCriticalSection(&conn_lock);
+                CloseHandle(connections[i].thread_handle);
+            }
+        }
+    }
+    LeaveCriticalSection(&conn_lock);
+
+    if (peer_mode != PEER_NONE) {
+        for (int i = 0; i < MUX_MAX_LINKS; i++) {
+            if (mux_links[i].reader_handle != NULL) {
+                WaitForSingleObject(mux_links[i].reader_handle, 2000);
+                CloseHandle(mux_links[i].reader_handle);
+                mux_links[i].reader_handle = NULL;
+            }
+        }
+    }
+
+    if (mirror_handle != NULL) {
+        SetEvent(mirror_event);
+        WaitForSingleObject(mirror_handle, 2000);
+        CloseHandle(mirror_handle);
+        mirror_handle = NULL;
+    }
+
+    if (maintenance_handle != NULL) {
+        WaitForSingleObject(maintenance_handle, 2000);
+        CloseHandle(maintenance_handle);
+        maintenance_handle = NULL;
+    }
+
+    // Let the writers drain what the relay threads left in their rings
+    writers_running = 0;
+    ring_writer_close(&capture_writer);
+    ring_writer_close(&record_writer);
+    ring_writer_close(&access_writer);
+
+    print_stats();
+    tls_free();
+    TRACE_UNREGISTER();
+    DeleteCriticalSection(&conn_lock);
+    WSACleanup();
+    printf("[INFO] Cleanup complete\n");
+}
+
+// Console control handler
+BOOL WINAPI console_handler(DWORD signal) {
+    if (signal == CTRL_C_EVENT || signal == CTRL_BREAK_EVENT) {
+        cleanup();
+        exit(0);
+    }
+    return TRUE;
+}
+
+int main(int argc, char* argv[]) {
+    WSADATA wsa_data;
+    struct sockaddr_storage server_addr;
+    int local_port, remote_port;
+    char* remote_host;
+    char* fallback_specs[MAX_BACKENDS];
+    int fallback_count = 0;
+
+    // Access log decoder: print a log as JSON lines or CSV and exit
+    if (argc >= 3 && strcmp(argv[1], "--decode-log") == 0) {
+        return access_log_decode(argv[2], argc >= 4 && strcmp(argv[3], "csv") == 0);
+    }
+
+    // Hash balancer microbenchmark: optional backend count and lookup count
+    if (argc >= 2 && strcmp(argv[1], "--bench-hash") == 0) {
+        return hash_bench(argc >= 3 ? atoi(argv[2]) : 8, argc >= 4 ? atoi(argv[3]) : 10000000);
+    }
+
+    // Control client: talk to a running forwarder and exit
+    if (argc >= 4 && strcmp(argv[1], "--ctl") == 0) {
+        return control_client(argv[2], argc - 3, argv + 3);
+    }
+
+    printf("=== Windows TCP Port Forwarder with IP Filtering ===\n\n");
+
+    // Parse arguments
+    if (argc < 4) {
+        fprintf(stderr, "Usage: %s <local_port> <remote_host> <remote_port> [allowed_ip] [-v] [options]\n", argv[0]);
+        fprintf(stderr, "       %s --decode-log <access_log> [json|csv]\n", argv[0]);
+        fprintf(stderr, "       %s --bench-hash [backends] [lookups]\n", argv[0]);
+        fprintf(stderr, "       %s --ctl <control_path> <list | kill <id> | drain [off] | ratelimit <id|all|default> <KB/s> | backends | backend <n> <up|down> | stats>\n", argv[0]);
+        fprintf(stderr, "  -v: Enable verbose mode (show rejected connections)\n");
+        fprintf(stderr, "  --ipv4-only: Listen on IPv4 only instead of IPv6 and IPv4\n");
+        fprintf(stderr, "  --tls-cert <subject>: Terminate TLS on the listener using a certificate from the MY store\n");
+        fprintf(stderr, "  --tls-session-lifetime <sec>: How long TLS sessions stay resumable\n");
+        fprintf(stderr, "  --tls-rotate <sec>: Rotate the TLS credential (and session cache) periodically\n");
+        fprintf(stderr, "  --peer-connect: Tunnel clients to a peer forwarder at remote_host:remote_port\n");
+        fprintf(stderr, "  --peer-listen: Accept tunnel links on local_port and deliver streams to remote_host:remote_port\n");
+        fprintf(stderr, "  --peer-links <n>: Links kept open by --peer-connect (default 2, max %d)\n", MUX_MAX_LINKS);
+        fprintf(stderr, "  --peer-stripe: Spread each stream over all peer links (bulk transfers on high-BDP paths)\n");
+        fprintf(stderr, "  --peer-window <KB>: Per-stream flow-control window (default %d)\n", MUX_DEFAULT_WINDOW / 1024);
+        fprintf(stderr, "  --peer-compress: LZ4-compress stream data between the forwarders\n");
+        fprintf(stderr, "  --mirror <host:port>: Copy client->remote traffic to a shadow backend (best effort)\n");
+        fprintf(stderr, "  --capture <file.pcapng>: Write relayed payloads as synthesized TCP packets\n");
+        fprintf(stderr, "  --capture-filter <ip>: Only capture connections from this address\n");
+        fprintf(stderr, "  --record <file>: Record connection timing and chunk sizes for --replay\n");
+        fprintf(stderr, "  --record-payload: Also record the relayed bytes\n");
+        fprintf(stderr, "  --replay <file>: Replay a recording: sink on local_port, clients via remote_host:remote_port\n");
+        fprintf(stderr, "  --replay-speed <x>: Replay speed-up (default 1, 0 = as fast as possible)\n");
+        fprintf(stderr, "  --replay-slow-sink <port,ms>: Also sink on port, delaying every response by ms\n");
+        fprintf(stderr, "  --control <path>: Serve a local control socket (use --ctl <path> <command> to talk to it)\n");
+        fprintf(stderr, "  --rate-limit <KB/s>: Limit each connection, per direction (adjustable via the control socket)\n");
+        fprintf(stderr, "  --access-log <file>: Write one binary record per closed connection\n");
+        fprintf(stderr, "  --idle-timeout <sec>: Close connections with no traffic for this long\n");
+        fprintf(stderr, "  --backlog <n>: Accept queue length to ask for (default SOMAXCONN)\n");
+        fprintf(stderr, "  --keepalive-client <spec>: Keepalive for client sockets: off or idle,interval[,count[,user_timeout]] (default 10,1)\n");
+        fprintf(stderr, "  --keepalive-remote <spec>: Same for sockets to the remote\n");
+        fprintf(stderr, "  --keepalive-peer <spec>: Same for peer tunnel links\n");
+        fprintf(stderr, "  --top: Show a live table of active connections, busiest first\n");
+        fprintf(stderr, "  --max-conns <n>: Shed new clients beyond n connections (default and max %d)\n", MAX_CONNECTIONS);
+        fprintf(stderr, "  --max-memory <MB>: Shed new clients once connections would use an estimated MB\n");
+        fprintf(stderr, "  --max-sockets <n>: Shed new clients once connections would hold n sockets\n");
+        fprintf(stderr, "  --priority-ip <ip>: Source that may use the reserved headroom (repeatable, max %d)\n", MAX_PRIORITY_IPS);
+        fprintf(stderr, "  --priority-reserve <n>: Connections' worth of headroom kept for priority sources (default 10%%)\n");
+        fprintf(stderr, "  --backend <host:port>: Another replica of remote_host:remote_port (repeatable, max %d in all)\n", MAX_BACKENDS);
+        fprintf(stderr, "  --balance <p2c|round-robin|hash>: How connections are spread over backends (default p2c)\n");
+        fprintf(stderr, "  --hash-load-factor <c>: With hash, cap each backend at c x the average load (default 1.25)\n");
+        fprintf(stderr, "  --fallback <host:port>: Backend tried only when connects to the others fail (repeatable)\n");
+        fprintf(stderr, "  --connect-timeout <ms>: Give up on each connect attempt after this long\n");
+        fprintf(stderr, "  --connect-retries <n>: Other backends tried after a failed connect (default one per backend, max 3)\n");
+        fprintf(stderr, "  --connect-budget <ms>: Total time a client's connect attempts may take\n");
+        fprintf(stderr, "  --warmup <sec>: Ramp a recovered backend's share of new connections up over this long\n");
+        fprintf(stderr, "  --breaker <n>: Open a backend's circuit after n consecutive connect failures\n");
+        fprintf(stderr, "  --breaker-cooldown <sec>: Fail clients fast this long before probing again (default 10)\n");
+        fprintf(stderr, "  --breaker-probes <n>: Trial connects let through while half-open (default 1)\n");
+        fprintf(stderr, "  --busy-poll <usec>: Spin this long after each chunk before sleeping in select()\n");
+        fprintf(stderr, "  --busy-poll-workers <n>: Connections that may spin at once (default 1, max %d)\n", BUSY_POLL_MAX_WORKERS);
+        fprintf(stderr, "  --busy-poll-cpu <n>: Pin spinning worker k to CPU n+k\n");
+        fprintf(stderr, "  --profile: Count TSC cycles spent in each stage (accept, DNS, connect, TLS, relay, logging)\n");
+        fprintf(stderr, "  --profile-sample <n>: With --profile, also keep a latency histogram of 1 in n timed events\n");
+        fprintf(stderr, "  --stats <sec>: Print counters periodically\n\n");
+        fprintf(stderr, "Examples:\n");
+        fprintf(stderr, "  %s 8080 192.168.1.100 80\n", argv[0]);
+        fprintf(stderr, "  %s 8080 192.168.1.100 80 192.168.1.50\n", argv[0]);
+        fprintf(stderr, "  %s 8080 192.168.1.100 80 192.168.1.50 -v\n", argv[0]);
+        fprintf(stderr, "  %s 443 192.168.1.100 80 --tls-cert forwarder.example.com\n", argv[0]);
+        fprintf(stderr, "  %s 5432 exit.example.com 9000 --peer-connect\n", argv[0]);
+        fprintf(stderr, "  %s 9000 10.0.0.20 5432 --peer-listen\n", argv[0]);
+        fprintf(stderr, "  %s 9001 127.0.0.1 9000 --replay prod.rec --replay-speed 4\n", argv[0]);
+        return 1;
+    }
+
+    if (parse_int(argv[1], 1, 65535, &local_port) != 0 || parse_int(argv[3], 1, 65535, &remote_port) != 0) {
+        fprintf(stderr, "[ERROR] Invalid port number\n");
+        return 1;
+    }
+    listen_port = local_port;
+    remote_host = argv[2];
+
+    // Parse optional arguments (allowed_ip and -v flag)
+    for (int i = 4; i < argc; i++) {
+        if (strcmp(argv[i], "-v") == 0 || strcmp(argv[i], "--verbose") == 0) {
+            verbose_mode = 1;
+        }
+        else if (strcmp(argv[i], "--ipv4-only") == 0) {
+            listen_family = AF_INET;
+        }
+        else if (strcmp(argv[i], "--tls-cert") == 0 && i + 1 < argc) {
+            tls_cert_subject = argv[++i];
+        }
+        else if (strcmp(argv[i], "--tls-session-lifetime") == 0 && i + 1 < argc) {
+            if (option_int(argv, &i, 0, (INT_MAX / 1000), &tls_session_lifetime) != 0) {
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--tls-rotate") == 0 && i + 1 < argc) {
+            if (option_int(argv, &i, 0, (INT_MAX / 1000), &tls_rotate_interval) != 0) {
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--peer-connect") == 0) {
+            peer_mode = PEER_ENTRY;
+        }
+        else if (strcmp(argv[i], "--peer-listen") == 0) {
+            peer_mode = PEER_EXIT;
+        }
+        else if (strcmp(argv[i], "--peer-links") == 0 && i + 1 < argc) {
+            if (option_int(argv, &i, 1, MUX_MAX_LINKS, &peer_link_count) != 0) {
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--peer-stripe") == 0) {
+            peer_stripe = 1;
+        }
+        else if (strcmp(argv[i], "--peer-compress") == 0) {
+            peer_compress = 1;
+        }
+        else if (strcmp(argv[i], "--peer-window") == 0 && i + 1 < argc) {
+            int window_kb;
+            if (option_int(argv, &i, MUX_MAX_PAYLOAD / 1024, MUX_MAX_WINDOW / 1024, &window_kb) != 0) {
+                return 1;
+            }
+            mux_window = window_kb * 1024;
+        }
+        else if (strcmp(argv[i], "--mirror") == 0 && i + 1 < argc) {
+            mirror_port = split_host_port(argv[++i], &mirror_host);
+            if (mirror_port == 0) {
+                fprintf(stderr, "[ERROR] --mirror expects host:port\n");
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--capture") == 0 && i + 1 < argc) {
+            capture_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--capture-filter") == 0 && i + 1 < argc) {
+            capture_filter = argv[++i];
+            if (parse_ip(capture_filter, &capture_filter_addr) != 0) {
+                fprintf(stderr, "[ERROR] --capture-filter expects an IPv4 or IPv6 address\n");
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+            record_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--record-payload") == 0) {
+            record_payloads = 1;
+        }
+        else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+            replay_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--replay-speed") == 0 && i + 1 < argc) {
+            if (option_double(argv, &i, 0.0, &replay_speed) != 0) {
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--replay-slow-sink") == 0 && i + 1 < argc) {
+            if (sscanf(argv[++i], "%d,%d", &replay_sinks[1].port, &replay_sinks[1].delay_ms) != 2 ||
+                replay_sinks[1].port <= 0 || replay_sinks[1].port > 65535 || replay_sinks[1].delay_ms < 0) {
+                fprintf(stderr, "[ERROR] --replay-slow-sink expects port,ms\n");
+                return 1;
+            }
+            replay_sink_count = 2;
+        }
+        else if (strcmp(argv[i], "--control") == 0 && i + 1 < argc) {
+            control_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--rate-limit") == 0 && i + 1 < argc) {
+            LONG limit;
+            if (parse_rate_limit(argv[++i], &limit) != 0) {
+                fprintf(stderr, "[ERROR] Invalid rate limit (0-%ld KB/s): %s\n", (long)(MAXLONG / 1024), argv[i]);
+                return 1;
+            }
+            default_rate_limit = limit;
+        }
+        else if (strcmp(argv[i], "--access-log") == 0 && i + 1 < argc) {
+            access_log_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--idle-timeout") == 0 && i + 1 < argc) {
+            if (option_int(argv, &i, 0, (INT_MAX / 1000), &idle_timeout) != 0) {
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--top") == 0) {
+            top_mode = 1;
+        }
+        else if (strcmp(argv[i], "--backlog") == 0 && i + 1 < argc) {
+            if (option_int(argv, &i, 0, 65535, &listen_backlog) != 0) {
+                return 1;
+            }
+        }
+        else if (strncmp(argv[i], "--keepalive-", 12) == 0 && i + 1 < argc) {
+            int leg = 0;
+            while (leg < LEG_COUNT && strcmp(argv[i] + 12, leg_names[leg]) != 0) {
+                leg++;
+            }
+            if (leg == LEG_COUNT) {
+                fprintf(stderr, "[ERROR] Unknown option: %s\n", argv[i]);
+                return 1;
+            }
+            if (parse_keepalive(argv[++i], &keepalive_profiles[leg]) != 0) {
+                fprintf(stderr, "[ERROR] Invalid keepalive profile: %s\n", argv[i]);
+                return 1;
+            }
+            keepalive_configured = 1;
+        }
+        else if (strcmp(argv[i], "--max-conns") == 0 && i + 1 < argc) {
+            if (option_int(argv, &i, 1, MAX_CONNECTIONS, &admit_limit) != 0) {
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--max-memory") == 0 && i + 1 < argc) {
+            int memory_mb;
+            if (option_int(argv, &i, 0, INT_MAX, &memory_mb) != 0) {
+                return 1;
+            }
+            memory_budget = (long long)memory_mb * 1024 * 1024;
+        }
+        else if (strcmp(argv[i], "--max-sockets") == 0 && i + 1 < argc) {
+            if (option_int(argv, &i, 0, INT_MAX, &socket_budget) != 0) {
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--priority-ip") == 0 && i + 1 < argc) {
+            if (priority_ip_count == MAX_PRIORITY_IPS) {
+                fprintf(stderr, "[ERROR] Too many priority IPs (max %d)\n", MAX_PRIORITY_IPS);
+                return 1;
+            }
+            if (parse_ip(argv[++i], &priority_ips[priority_ip_count]) != 0) {
+                fprintf(stderr, "[ERROR] --priority-ip expects an IPv4 or IPv6 address\n");
+                return 1;
+            }
+            priority_ip_count++;
+        }
+        else if (strcmp(argv[i], "--priority-reserve") == 0 && i + 1 < argc) {
+            if (option_int(argv, &i, 0, MAX_CONNECTIONS, &priority_reserve) != 0) {
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--backend") == 0 && i + 1 < argc) {
+            if (backend_count == MAX_BACKENDS - 1) {
+                fprintf(stderr, "[ERROR] Too many backends (max %d)\n", MAX_BACKENDS);
+                return 1;
+            }
+            backend_t* b = &backends[++backend_count];
+            char* host;
+            b->port = split_host_port(argv[++i], &host);
+            b->host = host;
+            if (b->port == 0) {
+                fprintf(stderr, "[ERROR] --backend expects host:port\n");
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--fallback") == 0 && i + 1 < argc) {
+            if (fallback_count == MAX_BACKENDS - 1) {
+                fprintf(stderr, "[ERROR] Too many backends (max %d)\n", MAX_BACKENDS);
+                return 1;
+            }
+            fallback_specs[fallback_count++] = argv[++i];
+        }
+        else if (strcmp(argv[i], "--connect-timeout") == 0 && i + 1 < argc) {
+            if (option_int(argv, &i, 0, INT_MAX, &connect_timeout_ms) != 0) {
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--connect-retries") == 0 && i + 1 < argc) {
+            if (option_int(argv, &i, 0, MAX_BACKENDS - 1, &connect_retries) != 0) {
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--connect-budget") == 0 && i + 1 < argc) {
+            if (option_int(argv, &i, 0, INT_MAX, &connect_budget_ms) != 0) {
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--balance") == 0 && i + 1 < argc) {
+            i++;
+            balance_policy = -1;
+            for (int p = 0; p < BALANCE_COUNT; p++) {
+                if (strcmp(argv[i], balance_names[p]) == 0) {
+                    balance_policy = p;
+                }
+            }
+            if (balance_policy < 0) {
+                fprintf(stderr, "[ERROR] --balance expects p2c, round-robin or hash\n");
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--hash-load-factor") == 0 && i + 1 < argc) {
+            if (option_double(argv, &i, 1.0, &hash_load_factor) != 0) {
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--warmup") == 0 && i + 1 < argc) {
+            if (option_int(argv, &i, 0, (INT_MAX / 1000), &warmup_seconds) != 0) {
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--breaker") == 0 && i + 1 < argc) {
+            if (option_int(argv, &i, 0, INT_MAX, &breaker_threshold) != 0) {
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--breaker-cooldown") == 0 && i + 1 < argc) {
+            if (option_int(argv, &i, 0, (INT_MAX / 1000), &breaker_cooldown) != 0) {
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--breaker-probes") == 0 && i + 1 < argc) {
+            if (option_int(argv, &i, 1, INT_MAX, &breaker_probes) != 0) {
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--busy-poll") == 0 && i + 1 < argc) {
+            if (option_int(argv, &i, 0, 1000000, &busy_poll_us) != 0) {
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--busy-poll-workers") == 0 && i + 1 < argc) {
+            if (option_int(argv, &i, 1, BUSY_POLL_MAX_WORKERS, &busy_poll_workers) != 0) {
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--busy-poll-cpu") == 0 && i + 1 < argc) {
+            if (option_int(argv, &i, 0, 63, &busy_poll_cpu) != 0) {
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--profile") == 0) {
+            profile_enabled = 1;
+        }
+        else if (strcmp(argv[i], "--profile-sample") == 0 && i + 1 < argc) {
+            profile_enabled = 1;
+            if (option_int(argv, &i, 0, INT_MAX, &profile_sample) != 0) {
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--stats") == 0 && i + 1 < argc) {
+            if (option_int(argv, &i, 0, (INT_MAX / 1000), &stats_interval) != 0) {
+                return 1;
+            }
+        }
+        else {
+            // Assume it's the allowed IP
+            allowed_ip = argv[i];
+            if (parse_ip(allowed_ip, &allowed_addr) != 0) {
+                fprintf(stderr, "[ERROR] Invalid allowed IP: %s\n", allowed_ip);
+                return 1;
+            }
+        }
+    }
+
+    // Keep a tenth of the connection limit for priority sources unless told otherwise
+    if (priority_reserve < 0) {
+        priority_reserve = priority_ip_count > 0 ? (admit_limit + 9) / 10 : 0;
+    }
+
+    if (peer_mode != PEER_NONE && tls_cert_subject != NULL) {
+        fprintf(stderr, "[ERROR] --tls-cert cannot be combined with peer tunnel modes\n");
+        return 1;
+    }
+
+    // Entry-side streams all ride the peer links; only the exit side can spread them
+    if ((backend_count > 0 || fallback_count > 0) && peer_mode == PEER_ENTRY) {
+        fprintf(stderr, "[ERROR] --backend and --fallback cannot be combined with --peer-connect\n");
+        return 1;
+    }
+
+    // The positional remote is backend 0; --backend entries follow it, then
+    // the --fallback entries, which are only tried when a connect fails
+    backends[0].host = remote_host;
+    backends[0].port = remote_port;
+    backend_count++;
+    primary_count = backend_count;
+    if (backend_count + fallback_count > MAX_BACKENDS) {
+        fprintf(stderr, "[ERROR] Too many backends (max %d)\n", MAX_BACKENDS);
+        return 1;
+    }
+    for (int i = 0; i < fallback_count; i++) {
+        backend_t* b = &backends[backend_count++];
+        char* host;
+        b->port = split_host_port(fallback_specs[i], &host);
+        b->host = host;
+        if (b->port == 0) {
+            fprintf(stderr, "[ERROR] --fallback expects host:port\n");
+            return 1;
+        }
+    }
+    for (int i = 0; i < backend_count; i++) {
+        snprintf(backends[i].label, sizeof(backends[i].label), peer_mode == PEER_ENTRY ? "peer %s:%d" : "%s:%d",
+            backends[i].host, backends[i].port);
+        InitializeCriticalSection(&backends[i].lock);
+    }
+    InitializeCriticalSection(&balance_lock);
+
+    // Streams from a peer forwarder carry no client address to hash
+    if (balance_policy == BALANCE_HASH && peer_mode == PEER_EXIT) {
+        fprintf(stderr, "[ERROR] --balance hash cannot be combined with --peer-listen\n");
+        return 1;
+    }
+    if (balance_policy == BALANCE_HASH && primary_count > 1) {
+        const char* names[MAX_BACKENDS];
+        for (int i = 0; i < primary_count; i++) {
+            names[i] = backends[i].label;
+        }
+        maglev_build(maglev_table, names, primary_count);
+    }
+
+    // Replay mode is a load generator and sink, not a forwarder
+    if (replay_path != NULL) {
+        return replay_run(local_port, remote_host, remote_port);
+    }
+
+    // Stage timings and spin limits are in time units, so measure the TSC rate up front
+    if (profile_enabled || busy_poll_us > 0) {
+        profile_calibrate();
+    }
+
+    printf("[INFO] Configuration:\n");
+    printf("  Local port:  %d\n", local_port);
+    printf("  Listening:   %s\n", listen_family == AF_INET6 ? "IPv6 and IPv4 (dual-stack)" : "IPv4 only");
+    printf("  Remote host: %s\n", remote_host);
+    printf("  Remote port: %d\n", remote_port);
+    if (primary_count > 1) {
+        printf("  Backends:    %d, balanced by %s (", primary_count,
+            balance_policy == BALANCE_P2C ? "peak-EWMA latency, power of two choices" :
+            balance_policy == BALANCE_HASH ? "client address (Maglev, bounded load)" : "round-robin");
+        for (int i = 0; i < primary_count; i++) {
+            printf("%s%s", i > 0 ? ", " : "", backends[i].label);
+        }
+        printf(")\n");
+        if (warmup_seconds > 0) {
+            printf("  Warm-up:     %d s linear ramp for recovered backends\n", warmup_seconds);
+        }
+    }
+    if (primary_count < backend_count) {
+        printf("  Fallbacks:  ");
+        for (int i = primary_count; i < backend_count; i++) {
+            printf(" %s", backends[i].label);
+        }
+        printf("\n");
+    }
+    if (backend_count > 1 || connect_timeout_ms > 0 || connect_budget_ms > 0) {
+        int retries = connect_retries >= 0 ? connect_retries : (backend_count - 1 < 3 ? backend_count - 1 : 3);
+        printf("  Connect:     %d retr%s", retries, retries == 1 ? "y" : "ies");
+        if (connect_timeout_ms > 0) {
+            printf(", %d ms per attempt", connect_timeout_ms);
+        }
+        if (connect_budget_ms > 0) {
+            printf(", %d ms in all", connect_budget_ms);
+        }
+        printf("\n");
+    }
+    if (peer_mode == PEER_ENTRY) {
+        printf("  Peer mode:   entry (%d links to peer forwarder%s%s, %d KB window)\n",
+            peer_link_count, peer_stripe ? ", striped" : "", peer_compress ? ", LZ4" : "",
+            mux_window / 1024);
+    }
+    else if (peer_mode == PEER_EXIT) {
+        printf("  Peer mode:   exit (accepting links from peer forwarder)\n");
+    }
+    if (allowed_ip != NULL) {
+        printf("  Allowed IP:  %s (filtered mode)\n", allowed_ip);
+        printf("  Verbose:     %s\n", verbose_mode ? "ON" : "OFF");
+    }
+    else {
+        printf("  Allowed IP:  ANY (no filtering)\n");
+    }
+    if (mirror_host != NULL) {
+        printf("  Mirror:      %s:%d (drop on overflow)\n", mirror_host, mirror_port);
+    }
+    if (capture_path != NULL) {
+        printf("  Capture:     %s (%s)\n", capture_path, capture_filter != NULL ? capture_filter : "all connections");
+    }
+    if (record_path != NULL) {
+        printf("  Record:      %s (%s)\n", record_path, record_payloads ? "with payloads" : "sizes only");
+    }
+    if (default_rate_limit > 0) {
+        printf("  Rate limit:  %ld KB/s per connection and direction\n", (long)default_rate_limit / 1024);
+    }
+    if (control_path != NULL) {
+        printf("  Control:     %s\n", control_path);
+    }
+    if (access_log_path != NULL) {
+        printf("  Access log:  %s (binary, read with --decode-log)\n", access_log_path);
+    }
+    if (listen_backlog > 0) {
+        printf("  Backlog:     %d\n", listen_backlog);
+    }
+    if (keepalive_configured) {
+        char profiles[LEG_COUNT][48];
+        for (int leg = 0; leg < LEG_COUNT; leg++) {
+            format_keepalive(profiles[leg], sizeof(profiles[leg]), &keepalive_profiles[leg]);
+        }
+        printf("  Keepalive:   client %s, remote %s%s%s\n", profiles[LEG_CLIENT], profiles[LEG_REMOTE],
+            peer_mode != PEER_NONE ? ", peer " : "", peer_mode != PEER_NONE ? profiles[LEG_PEER] : "");
+    }
+    if (admit_limit < MAX_CONNECTIONS || memory_budget > 0 || socket_budget > 0 || priority_ip_count > 0) {
+        printf("  Admission:   %d connections", admit_limit);
+        if (memory_budget > 0) {
+            printf(", %lld MB (~%lld KB each)", memory_budget / (1024 * 1024), conn_memory_estimate() / 1024);
+        }
+        if (socket_budget > 0) {
+            printf(", %d sockets", socket_budget);
+        }
+        if (priority_ip_count > 0) {
+            printf(", %d reserved for %d priority source%s", priority_reserve, priority_ip_count,
+                priority_ip_count == 1 ? "" : "s");
+        }
+        printf("\n");
+    }
+    if (breaker_threshold > 0) {
+        printf("  Breaker:     open after %d connect failures, probe after %d s (%d at a time)\n",
+            breaker_threshold, breaker_cooldown, breaker_probes);
+    }
+    if (busy_poll_us > 0) {
+        printf("  Busy poll:   %d us before sleeping, %d worker%s", busy_poll_us, busy_poll_workers,
+            busy_poll_workers == 1 ? "" : "s");
+        if (busy_poll_cpu >= 0) {
+            printf(" pinned to CPU %d-%d", busy_poll_cpu, busy_poll_cpu + busy_poll_workers - 1);
+        }
+        printf("\n");
+    }
+    if (profile_enabled) {
+        printf("  Profile:     per-stage TSC cycles (%.0f MHz)", profile_tsc_per_us);
+        if (profile_sample > 0) {
+            printf(", histogram of 1 in %d events", profile_sample);
+        }
+        printf("\n");
+    }
+    if (tls_cert_subject != NULL) {
+        printf("  TLS:         ON (certificate \"%s\")\n", tls_cert_subject);
+        if (tls_session_lifetime > 0) {
+            printf("  TLS session: resumable for %d s\n", tls_session_lifetime);
+        }
+        if (tls_rotate_interval > 0) {
+            printf("  TLS rotate:  every %d s\n", tls_rotate_interval);
+        }
+    }
+    printf("\n");
+
+    // Initialize Winsock
+    if (WSAStartup(MAKEWORD(2, 2), &wsa_data) != 0) {
+        fprintf(stderr, "[ERROR] WSAStartup() failed\n");
+        return 1;
+    }
+
+    // Lifecycle tracepoints stay idle until a trace session enables the provider
+    TRACE_REGISTER();
+
+    // Initialize critical section and connections
+    InitializeCriticalSection(&conn_lock);
+    memset(connections, 0, sizeof(connections));
+
+    // Peer tunnel streams need per-slot locks and wakeup events
+    if (peer_mode != PEER_NONE) {
+        for (int i = 0; i < MAX_CONNECTIONS; i++) {
+            InitializeCriticalSection(&connections[i].stream_lock);
+            connections[i].rx_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+            connections[i].tx_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+        }
+        for (int i = 0; i < MUX_MAX_LINKS; i++) {
+            mux_links[i].socket = INVALID_SOCKET;
+            InitializeCriticalSection(&mux_links[i].send_lock);
+        }
+    }
+
+    // Set console handler for cleanup
+    SetConsoleCtrlHandler(console_handler, TRUE);
+
+    // Load TLS certificate before accepting any clients
+    if (tls_cert_subject != NULL && tls_init(tls_cert_subject) != 0) {
+        cleanup();
+        return 1;
+    }
+
+    maintenance_handle = CreateThread(NULL, 0, maintenance_thread, NULL, 0, NULL);
+
+    // Mirror queue and its delivery thread
+    if (mirror_host != NULL) {
+        mirror_queue = (mirror_entry_t*)malloc(sizeof(mirror_entry_t) * MIRROR_QUEUE_SLOTS);
+        if (mirror_queue == NULL) {
+            fprintf(stderr, "[ERROR] Out of memory for mirror queue\n");
+            cleanup();
+            return 1;
+        }
+        InitializeCriticalSection(&mirror_lock);
+        mirror_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+        for (int i = 0; i < MAX_CONNECTIONS; i++) {
+            mirror_targets[i].socket = INVALID_SOCKET;
+        }
+        mirror_handle = CreateThread(NULL, 0, mirror_thread, NULL, 0, NULL);
+    }
+
+    // Capture ring and its writer thread
+    if (capture_path != NULL) {
+        if (capture_init(capture_path) != 0) {
+            cleanup();
+            return 1;
+        }
+        capture_writer.handle = CreateThread(NULL, 0, ring_writer_thread, &capture_writer, 0, NULL);
+    }
+
+    // Access log ring and its writer thread
+    if (access_log_path != NULL) {
+        if (access_log_init(access_log_path) != 0) {
+            cleanup();
+            return 1;
+        }
+        access_writer.handle = CreateThread(NULL, 0, ring_writer_thread, &access_writer, 0, NULL);
+    }
+
+    // Recorder ring and its writer thread
+    if (record_path != NULL) {
+        if (record_init(record_path) != 0) {
+            cleanup();
+            return 1;
+        }
+        record_writer.handle = CreateThread(NULL, 0, ring_writer_thread, &record_writer, 0, NULL);
+    }
+
+    // Control socket for operators
+    if (control_path != NULL) {
+        if (control_init(control_path) != 0) {
+            cleanup();
+            return 1;
+        }
+        control_handle = CreateThread(NULL, 0, control_thread, NULL, 0, NULL);
+    }
+
+    // Bring the tunnel links up front so the first clients skip the WAN handshake
+    if (peer_mode == PEER_ENTRY) {
+        LARGE_INTEGER counter;
+        QueryPerformanceCounter(&counter);
+        mux_session_id = ((ULONGLONG)GetCurrentProcessId() << 48) ^ (ULONGLONG)counter.QuadPart ^ GetTickCount64();
+        for (int i = 0; i < peer_link_count; i++) {
+            if (mux_connect_link(&mux_links[i], remote_host, remote_port) != 0) {
+                fprintf(stderr, "[ERROR] Peer link %d not connected, will retry in the background\n", i);
+            }
+        }
+        mux_redial_handle = CreateThread(NULL, 0, mux_redial_thread, NULL, 0, NULL);
+    }
+
+    // Create listening socket; fall back to IPv4 where the IPv6 stack is missing
+    listen_socket = socket(listen_family, SOCK_STREAM, IPPROTO_TCP);
+    if (listen_socket == INVALID_SOCKET && listen_family == AF_INET6) {
+        printf("[WARN] IPv6 listener unavailable (%d), listening on IPv4 only\n", WSAGetLastError());
+        listen_family = AF_INET;
+        listen_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    }
+    if (listen_socket == INVALID_SOCKET) {
+        print_error("socket() creation failed");
+        WSACleanup();
+        return 1;
+    }
+
+    // Set socket options
+    int reuse = 1;
+    if (setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR,
+        (char*)&reuse, sizeof(reuse)) == SOCKET_ERROR) {
+        print_error("setsockopt() failed");
+    }
+
+    // Accept IPv4 clients on the IPv6 socket too (Windows defaults to V6ONLY)
+    if (listen_family == AF_INET6) {
+        int v6only = 0;
+        if (setsockopt(listen_socket, IPPROTO_IPV6, IPV6_V6ONLY,
+            (char*)&v6only, sizeof(v6only)) == SOCKET_ERROR) {
+            print_error("setsockopt(IPV6_V6ONLY) failed");
+        }
+    }
+
+    // Bind socket
+    ZeroMemory(&server_addr, sizeof(server_addr));
+    if (listen_family == AF_INET6) {
+        struct sockaddr_in6* v6 = (struct sockaddr_in6*)&server_addr;
+        v6->sin6_family = AF_INET6;
+        v6->sin6_addr = in6addr_any;
+        v6->sin6_port = htons(local_port);
+    }
+    else {
+        struct sockaddr_in* v4 = (struct sockaddr_in*)&server_addr;
+        v4->sin_family = AF_INET;
+        v4->sin_addr.s_addr = INADDR_ANY;
+        v4->sin_port = htons(local_port);
+    }
+
+    if (bind(listen_socket, (struct sockaddr*)&server_addr, addr_size(&server_addr)) == SOCKET_ERROR) {
+        print_error("bind() failed");
+        cleanup();
+        return 1;
+    }
+
+    // Listen for connections; SOMAXCONN_HINT asks for an exact queue length
+    if (listen(listen_socket, listen_backlog > 0 ? SOMAXCONN_HINT(listen_backlog) : SOMAXCONN) == SOCKET_ERROR) {
+        print_error("listen() failed");
+        cleanup();
+        return 1;
+    }
+
+    // Set the relay options once on the listener so accepted sockets inherit
+    // whatever they can, and make it non-blocking so the accept loop can drain it
+    listener_inherited = probe_inherited_options(listen_family);
+    configure_socket(listen_socket, LEG_CLIENT, SOCKOPT_ALL & ~SOCKOPT_BLOCKING);
+    u_long nonblocking = 1;
+    ioctlsocket(listen_socket, FIONBIO, &nonblocking);
+    stat_setup_syscalls = 0;
+    if (verbose_mode) {
+        printf("[INFO] Accepted sockets inherit:%s%s%s\n",
+            (listener_inherited & SOCKOPT_TIMEOUTS) ? " timeouts" : "",
+            (listener_inherited & SOCKOPT_NODELAY) ? " nodelay" : "",
+            (listener_inherited & SOCKOPT_KEEPALIVE) ? " keepalive" : "");
+    }
+
+    printf("[INFO] Listening on port %d...\n", local_port);
+    printf("[INFO] Press Ctrl+C to stop\n\n");
+
+    // The table is drawn on the console; per-connection [INFO] lines would scroll it away
+    if (top_mode) {
+        HANDLE console = CreateFileA("CONOUT$", GENERIC_READ | GENERIC_WRITE, FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+        DWORD console_mode;
+        if (console == INVALID_HANDLE_VALUE || fopen_s(&top_out, "CONOUT$", "w") != 0) {
+            fprintf(stderr, "[ERROR] --top needs a console\n");
+            cleanup();
+            return 1;
+        }
+        if (GetConsoleMode(console, &console_mode)) {
+            SetConsoleMode(console, console_mode | ENABLE_VIRTUAL_TERMINAL_PROCESSING);
+        }
+        CloseHandle(console);
+        if (GetFileType(GetStdHandle(STD_OUTPUT_HANDLE)) == FILE_TYPE_CHAR) {
+            FILE* devnull;
+            freopen_s(&devnull, "NUL", "w", stdout);
+        }
+    }
+
+    // Accept connections. The listener is non-blocking: wait for readiness,
+    // then take every connection already queued before waiting again.
+    while (running) {
+        fd_set readfds;
+        struct timeval timeout;
+        FD_ZERO(&readfds);
+        FD_SET(listen_socket, &readfds);
+        timeout.tv_sec = 1;
+        timeout.tv_usec = 0;
+
+        int ready = select(0, &readfds, NULL, NULL, &timeout);
+        InterlockedIncrement64(&stat_setup_syscalls);
+        if (ready == SOCKET_ERROR) {
+            if (running) {
+                print_error("select() failed");
+            }
+            break;
+        }
+        if (ready == 0) {
+            continue;
+        }
+
+        int error = 0;
+        while (running) {
+            struct sockaddr_storage client_addr;
+            int client_addr_len = sizeof(client_addr);
+
+            SOCKET client_socket = accept(listen_socket,
+                (struct sockaddr*)&client_addr,
+                &client_addr_len);
+            InterlockedIncrement64(&stat_setup_syscalls);
+
+            if (client_socket == INVALID_SOCKET) {
+                error = WSAGetLastError();
+                break;
+            }
+            InterlockedIncrement64(&stat_accepts);
+            addr_unmap(&client_addr);
+            accept_client(client_socket, &client_addr, remote_host, remote_port);
+        }
+
+        // Queue drained; a client that reset while queued is no reason to stop
+        if (error != WSAEWOULDBLOCK && error != WSAECONNRESET && error != 0) {
+            if (running) {
+                WSASetLastError(error);
+                print_error("accept() failed");
+            }
+            break;
+        }
+    }
+
+    profile_flush();  // The accept loop's own stage totals
+    cleanup();
+    return 0;
 }
\ No newline at end of file